@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include "kvm.h"
+#include "acpi.h"
+#include "kvm/bios.h"
+
+/*
+ * Just enough ACPI for the guest to find its NUMA layout: an RSDP in the
+ * BIOS area pointing at an RSDT with an SRAT and a SLIT. CPUs and
+ * interrupts still come from the MP table.
+ */
+
+#define ACPI_TABLES_BEGIN	MB_FIRMWARE_BIOS_BEGIN
+#define ACPI_TABLES_MAX_SIZE	(MB_BIOS_BEGIN - MB_FIRMWARE_BIOS_BEGIN)
+
+#define ACPI_OEM_ID		"KVMCPU"
+#define ACPI_OEM_TABLE_ID	"KVMCPU00"
+
+struct acpi_rsdp {
+	char		signature[8];		/* "RSD PTR " */
+	uint8_t		checksum;
+	char		oem_id[6];
+	uint8_t		revision;		/* 0: ACPI 1.0, RSDT only */
+	uint32_t	rsdt_address;
+} __attribute__((packed));
+
+struct acpi_header {
+	char		signature[4];
+	uint32_t	length;
+	uint8_t		revision;
+	uint8_t		checksum;
+	char		oem_id[6];
+	char		oem_table_id[8];
+	uint32_t	oem_revision;
+	char		creator_id[4];
+	uint32_t	creator_revision;
+} __attribute__((packed));
+
+struct acpi_srat {
+	struct acpi_header	header;
+	uint32_t		table_revision;	/* 1 */
+	uint64_t		reserved;
+} __attribute__((packed));
+
+struct acpi_srat_cpu {
+	uint8_t		type;			/* 0 */
+	uint8_t		length;			/* 16 */
+	uint8_t		proximity_lo;
+	uint8_t		apic_id;
+	uint32_t	flags;
+	uint8_t		local_sapic_eid;
+	uint8_t		proximity_hi[3];
+	uint32_t	clock_domain;
+} __attribute__((packed));
+
+struct acpi_srat_mem {
+	uint8_t		type;			/* 1 */
+	uint8_t		length;			/* 40 */
+	uint32_t	proximity;
+	uint16_t	reserved1;
+	uint64_t	base;
+	uint64_t	size;
+	uint32_t	reserved2;
+	uint32_t	flags;
+	uint64_t	reserved3;
+} __attribute__((packed));
+
+struct acpi_slit {
+	struct acpi_header	header;
+	uint64_t		localities;
+	uint8_t			entry[];
+} __attribute__((packed));
+
+#define ACPI_SRAT_ENABLED	1
+
+#define ALIGN16(x)		(((x) + 15) & ~15UL)
+
+/* Same distances the host reports, or the ACPI defaults without it */
+#define ACPI_DISTANCE_LOCAL	10
+#define ACPI_DISTANCE_REMOTE	20
+
+static uint8_t acpi_checksum(void *p, size_t len)
+{
+	uint8_t sum = 0, *b = p;
+
+	while (len--)
+		sum += *b++;
+
+	return -sum;
+}
+
+static void acpi_header(struct acpi_header *hdr, const char *sig, uint32_t len, uint8_t rev)
+{
+	memcpy(hdr->signature, sig, 4);
+	hdr->length		= len;
+	hdr->revision		= rev;
+	memcpy(hdr->oem_id, ACPI_OEM_ID, 6);
+	memcpy(hdr->oem_table_id, ACPI_OEM_TABLE_ID, 8);
+	hdr->oem_revision	= 1;
+	memcpy(hdr->creator_id, "KVMC", 4);
+	hdr->creator_revision	= 1;
+	hdr->checksum		= 0;
+	hdr->checksum		= acpi_checksum(hdr, len);
+}
+
+static int host_node_distance(int from, int to)
+{
+	char path[64];
+	FILE *f;
+	int i, d = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance", from);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	for (i = 0; i <= to; i++) {
+		if (fscanf(f, "%d", &d) != 1) {
+			d = -1;
+			break;
+		}
+	}
+
+	fclose(f);
+	return d;
+}
+
+static uint8_t node_distance(struct kvm *kvm, unsigned int from, unsigned int to)
+{
+	int h_from = kvm->numa_nodes[from].host_node;
+	int h_to = kvm->numa_nodes[to].host_node;
+	int d;
+
+	if (from == to)
+		return ACPI_DISTANCE_LOCAL;
+
+	if (h_from >= 0 && h_to >= 0) {
+		d = host_node_distance(h_from, h_to);
+		/* Guest nodes are distinct even if they share a host node */
+		if (d > ACPI_DISTANCE_LOCAL && d < 255)
+			return d;
+	}
+
+	return ACPI_DISTANCE_REMOTE;
+}
+
+/**
+ * acpi__init - build RSDP/RSDT/SRAT/SLIT for the configured NUMA nodes
+ */
+int acpi__init(struct kvm *kvm)
+{
+	const struct kvm_mem_table *table = kvm->mem_table;
+	unsigned int i, j, nr_nodes = kvm->nr_numa_nodes;
+	struct acpi_srat_cpu *cpu;
+	struct acpi_srat_mem *mem;
+	struct acpi_header *rsdt;
+	struct acpi_srat *srat;
+	struct acpi_slit *slit;
+	struct acpi_rsdp *rsdp;
+	unsigned long srat_len, slit_len, rsdt_len;
+	unsigned long rsdt_off, srat_off, slit_off, size;
+	void *buf;
+
+	if (!nr_nodes)
+		return 0;
+
+	srat_len = sizeof(*srat) + kvm->nrcpus * sizeof(*cpu) + table->nr * sizeof(*mem);
+	slit_len = sizeof(*slit) + nr_nodes * nr_nodes;
+	rsdt_len = sizeof(*rsdt) + 2 * sizeof(uint32_t);
+
+	/* RSDP first, so it sits on the 16 byte boundary the guest scans */
+	rsdt_off = ALIGN16(sizeof(*rsdp));
+	srat_off = ALIGN16(rsdt_off + rsdt_len);
+	slit_off = ALIGN16(srat_off + srat_len);
+	size = slit_off + slit_len;
+
+	if (size > ACPI_TABLES_MAX_SIZE) {
+		fprintf(stderr, "ACPI tables are too big");
+		return -E2BIG;
+	}
+
+	buf = calloc(1, size);
+	if (!buf)
+		return -ENOMEM;
+
+	rsdp = buf;
+	rsdt = buf + rsdt_off;
+	srat = buf + srat_off;
+	slit = buf + slit_off;
+
+	/*
+	 * SRAT: every vCPU by APIC ID, and every RAM bank, with its node.
+	 */
+	cpu = (void *)&srat[1];
+	for (i = 0; i < (unsigned int)kvm->nrcpus; i++) {
+		cpu->type		= 0;
+		cpu->length		= sizeof(*cpu);
+		cpu->proximity_lo	= kvm->cpu_node[i];
+		cpu->apic_id		= kvm__cpu_apic_id(kvm, i);
+		cpu->flags		= ACPI_SRAT_ENABLED;
+		cpu++;
+	}
+
+	mem = (void *)cpu;
+	for (i = 0; i < table->nr; i++) {
+		mem->type		= 1;
+		mem->length		= sizeof(*mem);
+		mem->proximity		= table->ranges[i].bank->node;
+		mem->base		= table->ranges[i].guest_phys_addr;
+		mem->size		= table->ranges[i].size;
+		mem->flags		= ACPI_SRAT_ENABLED;
+		mem++;
+	}
+
+	srat->table_revision = 1;
+	acpi_header(&srat->header, "SRAT", srat_len, 3);
+
+	/*
+	 * SLIT: node distances.
+	 */
+	slit->localities = nr_nodes;
+	for (i = 0; i < nr_nodes; i++)
+		for (j = 0; j < nr_nodes; j++)
+			slit->entry[i * nr_nodes + j] = node_distance(kvm, i, j);
+	acpi_header(&slit->header, "SLIT", slit_len, 1);
+
+	/*
+	 * RSDT and RSDP, with guest physical addresses.
+	 */
+	((uint32_t *)&rsdt[1])[0] = ACPI_TABLES_BEGIN + srat_off;
+	((uint32_t *)&rsdt[1])[1] = ACPI_TABLES_BEGIN + slit_off;
+	acpi_header(rsdt, "RSDT", rsdt_len, 1);
+
+	memcpy(rsdp->signature, "RSD PTR ", 8);
+	memcpy(rsdp->oem_id, ACPI_OEM_ID, 6);
+	rsdp->revision		= 0;
+	rsdp->rsdt_address	= ACPI_TABLES_BEGIN + rsdt_off;
+	rsdp->checksum		= acpi_checksum(rsdp, sizeof(*rsdp));
+
+	if (guest_memcpy_to(kvm, ACPI_TABLES_BEGIN, buf, size) < 0) {
+		free(buf);
+		return -EFAULT;
+	}
+
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef KVM_ACPI_H_
+#define KVM_ACPI_H_
+
+struct kvm;
+
+int acpi__init(struct kvm *kvm);
+
+#endif /* KVM_ACPI_H_ */
@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "kvm.h"
+#include "control.h"
+#include "dirty.h"
+#include "stats.h"
+#include "wss.h"
+#include "zero.h"
+
+#define CONTROL_MSG_MAX		4096
+
+static int control_fd = -1;
+static char control_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static int control_reply(int fd, const char *msg, size_t len, int pass_fd)
+{
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = (void *)msg, .iov_len = len };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+    struct cmsghdr *cmsg;
+
+    if (pass_fd >= 0) {
+        memset(cbuf, 0, sizeof(cbuf));
+        mh.msg_control = cbuf;
+        mh.msg_controllen = sizeof(cbuf);
+
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+
+    return sendmsg(fd, &mh, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static int control_memfd(struct kvm *kvm, int fd)
+{
+    const struct kvm_mem_table *table = __atomic_load_n(&kvm->mem_table, __ATOMIC_ACQUIRE);
+    char msg[CONTROL_MSG_MAX];
+    unsigned int i;
+    int len;
+
+    if (kvm->ram_fd < 0) {
+        len = snprintf(msg, sizeof(msg), "error guest RAM has no memfd, use --mem-backend memfd\n");
+        return control_reply(fd, msg, len, -1);
+    }
+
+    len = snprintf(msg, sizeof(msg), "memfd %llu\n", (unsigned long long)kvm->ram_pagesize);
+    for (i = 0; table && i < table->nr && len < (int)sizeof(msg); i++) {
+        const struct kvm_mem_range *range = &table->ranges[i];
+
+        len += snprintf(msg + len, sizeof(msg) - len, "bank 0x%llx 0x%llx 0x%llx\n",
+                (unsigned long long)range->guest_phys_addr,
+                (unsigned long long)range->size,
+                (unsigned long long)range->bank->fd_offset);
+    }
+    if (len >= (int)sizeof(msg))
+        len = sizeof(msg) - 1;
+
+    return control_reply(fd, msg, len, kvm->ram_fd);
+}
+
+struct dirty_count {
+    uint64_t pages;
+    uint64_t ranges;
+};
+
+static int dirty_count_range(struct kvm *kvm, uint64_t addr, uint64_t len, void *ptr)
+{
+    struct dirty_count *count = ptr;
+
+    count->pages += len / PAGE_SIZE;
+    count->ranges++;
+    return 0;
+}
+
+static int control_dirty_log(struct kvm *kvm, int fd, const char *arg)
+{
+    struct dirty_count count = { 0 };
+    char msg[128];
+    int len, ret;
+
+    /* Collecting clears the log, so it can only have one reader */
+    if (kvm__wss_uses_dirty_log(kvm)) {
+        len = snprintf(msg, sizeof(msg), "error the dirty log is in use by the working set sampler\n");
+        return control_reply(fd, msg, len, -1);
+    }
+
+    if (!strcmp(arg, "start")) {
+        ret = kvm__dirty_log_start(kvm);
+    } else if (!strcmp(arg, "stop")) {
+        ret = kvm__dirty_log_stop(kvm);
+    } else if (!strcmp(arg, "collect")) {
+        ret = kvm__dirty_log_collect(kvm, dirty_count_range, &count);
+    } else {
+        len = snprintf(msg, sizeof(msg), "error dirty-log takes start, stop or collect\n");
+        return control_reply(fd, msg, len, -1);
+    }
+
+    if (ret < 0)
+        len = snprintf(msg, sizeof(msg), "error %s\n", strerror(-ret));
+    else
+        len = snprintf(msg, sizeof(msg), "dirty %llu %llu\n",
+                   (unsigned long long)count.pages, (unsigned long long)count.ranges);
+
+    return control_reply(fd, msg, len, -1);
+}
+
+/* Sends what @dump prints as one reply */
+static int control_report(struct kvm *kvm, int fd, void (*dump)(struct kvm *, FILE *))
+{
+    char *msg = NULL;
+    size_t len = 0;
+    FILE *out;
+    int ret;
+
+    out = open_memstream(&msg, &len);
+    if (!out)
+        return -1;
+    dump(kvm, out);
+    fclose(out);
+
+    ret = control_reply(fd, msg, len < CONTROL_MSG_MAX ? len : CONTROL_MSG_MAX, -1);
+    free(msg);
+    return ret;
+}
+
+static void control_handle(struct kvm *kvm, int fd)
+{
+    char cmd[256], *end;
+    ssize_t len;
+
+    while ((len = recv(fd, cmd, sizeof(cmd) - 1, 0)) > 0) {
+        cmd[len] = '\0';
+        end = strpbrk(cmd, "\r\n");
+        if (end)
+            *end = '\0';
+
+        if (!strcmp(cmd, "memfd")) {
+            if (control_memfd(kvm, fd) < 0)
+                break;
+        } else if (!strcmp(cmd, "ksm")) {
+            if (control_report(kvm, fd, kvm__ksm_dump) < 0)
+                break;
+        } else if (!strcmp(cmd, "zero")) {
+            if (control_report(kvm, fd, kvm__zero_scan_dump) < 0)
+                break;
+        } else if (!strcmp(cmd, "wss")) {
+            if (!kvm->wss) {
+                static const char off[] = "error working set sampler is off, use --wss\n";
+
+                if (control_reply(fd, off, sizeof(off) - 1, -1) < 0)
+                    break;
+            } else if (control_report(kvm, fd, kvm__wss_dump) < 0) {
+                break;
+            }
+        } else if (!strncmp(cmd, "dirty-log ", 10)) {
+            if (control_dirty_log(kvm, fd, cmd + 10) < 0)
+                break;
+        } else {
+            static const char unknown[] = "error unknown command\n";
+
+            if (control_reply(fd, unknown, sizeof(unknown) - 1, -1) < 0)
+                break;
+        }
+    }
+}
+
+static void *control_thread(void *param)
+{
+    struct kvm *kvm = param;
+
+    kvm__set_thread_name("kvm-control");
+
+    /* One client at a time is plenty for a management socket */
+    while (1) {
+        int fd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("control socket accept");
+            break;
+        }
+
+        control_handle(kvm, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int kvm__control_init(struct kvm *kvm, const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    pthread_t thread;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    control_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (control_fd < 0) {
+        perror("control socket");
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(control_fd, 4) < 0) {
+        perror("control socket bind");
+        goto fail;
+    }
+    strcpy(control_path, path);
+
+    if (pthread_create(&thread, NULL, control_thread, kvm) != 0) {
+        perror("unable to create control thread");
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    close(control_fd);
+    control_fd = -1;
+    return -1;
+}
+
+void kvm__control_exit(struct kvm *kvm)
+{
+    if (control_fd < 0)
+        return;
+
+    unlink(control_path);
+}
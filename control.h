@@ -0,0 +1,28 @@
+#ifndef KVM__CONTROL_H
+#define KVM__CONTROL_H
+
+#include "kvm.h"
+
+/*
+ * Control socket: a SOCK_SEQPACKET UNIX socket, one text command per
+ * message, one reply per command. Commands:
+ *
+ *   memfd	replies "memfd <page size>" followed by one
+ *		"bank <gpa> <size> <file offset>" line per RAM bank, with
+ *		the guest RAM memfd attached as SCM_RIGHTS
+ *
+ *   dirty-log start|stop|collect
+ *		turns dirty logging on or off for all RAM, or collects and
+ *		clears it; replies "dirty <pages> <ranges>". Refused while
+ *		the working set sampler reads the dirty log
+ *
+ *   ksm	replies with the KSM report also printed by SIGUSR1
+ *
+ *   wss	replies with the working set histogram, see wss.h
+ *
+ *   zero	replies with the zero page scanner's progress, see zero.h
+ */
+int kvm__control_init(struct kvm *kvm, const char *path);
+void kvm__control_exit(struct kvm *kvm);
+
+#endif /* KVM__CONTROL_H */
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/kvm.h>
+#include "kvm.h"
+#include "dirty.h"
+
+#define BITS_PER_LONG		(8 * sizeof(unsigned long))
+#define BITMAP_LONGS(bits)	(((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+/*
+ * Serialises collectors against each other and, with dirty rings, against
+ * vCPUs draining a full ring into the bank bitmaps.
+ */
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int kvm__set_bank_region(struct kvm *kvm, struct kvm_mem_bank *bank)
+{
+    struct kvm_userspace_memory_region mem = {
+        .slot = bank->slot,
+        .flags = bank->flags,
+        .guest_phys_addr = bank->guest_phys_addr,
+        .memory_size = bank->size,
+        .userspace_addr = (unsigned long)bank->host_addr,
+    };
+
+    return ioctl(kvm->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem);
+}
+
+int kvm__dirty_log_enable(struct kvm *kvm, struct kvm_mem_bank *bank, int enable)
+{
+    uint64_t npages = bank->size / PAGE_SIZE;
+    int ret = 0;
+
+    pthread_mutex_lock(&dirty_lock);
+
+    if (enable && !bank->dirty_bitmap) {
+        bank->dirty_bitmap = calloc(BITMAP_LONGS(npages), sizeof(unsigned long));
+        if (!bank->dirty_bitmap) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    if (enable)
+        bank->flags |= KVM_MEM_LOG_DIRTY_PAGES;
+    else
+        bank->flags &= ~KVM_MEM_LOG_DIRTY_PAGES;
+
+    if (kvm__set_bank_region(kvm, bank) < 0) {
+        ret = -errno;
+        perror("KVM_SET_USER_MEMORY_REGION ioctl");
+    }
+
+out:
+    pthread_mutex_unlock(&dirty_lock);
+    return ret;
+}
+
+int kvm__dirty_log_start(struct kvm *kvm)
+{
+    struct kvm_mem_bank *bank;
+    int ret;
+
+    list_for_each_entry(bank, &kvm->mem_banks, list) {
+        ret = kvm__dirty_log_enable(kvm, bank, 1);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int kvm__dirty_log_stop(struct kvm *kvm)
+{
+    struct kvm_mem_bank *bank;
+    int ret;
+
+    list_for_each_entry(bank, &kvm->mem_banks, list) {
+        ret = kvm__dirty_log_enable(kvm, bank, 0);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Dirty rings. KVM wants them enabled on the VM before any vCPU exists;
+ * each vCPU then maps its own ring of kvm_dirty_gfn entries.
+ */
+int kvm__dirty_ring_init(struct kvm *kvm, uint32_t entries)
+{
+    struct kvm_enable_cap cap = {
+        .cap = KVM_CAP_DIRTY_LOG_RING,
+        .args[0] = entries * sizeof(struct kvm_dirty_gfn),
+    };
+    int max;
+
+    max = ioctl(kvm->sys_fd, KVM_CHECK_EXTENSION, KVM_CAP_DIRTY_LOG_RING);
+    if (max <= 0) {
+        fprintf(stderr, "Dirty rings are not supported by this host\n");
+        return -1;
+    }
+
+    if (entries & (entries - 1) || cap.args[0] < PAGE_SIZE || cap.args[0] > (uint64_t)max) {
+        fprintf(stderr, "Dirty ring size must be a power of two, %lu to %lu entries\n",
+            PAGE_SIZE / sizeof(struct kvm_dirty_gfn), max / sizeof(struct kvm_dirty_gfn));
+        return -1;
+    }
+
+    if (ioctl(kvm->vm_fd, KVM_ENABLE_CAP, &cap) < 0) {
+        perror("KVM_ENABLE_CAP(KVM_CAP_DIRTY_LOG_RING)");
+        return -1;
+    }
+
+    kvm->dirty_ring_entries = entries;
+    return 0;
+}
+
+int kvm_cpu__dirty_ring_map(struct kvm_cpu *vcpu)
+{
+    struct kvm *kvm = vcpu->kvm;
+
+    if (!kvm->dirty_ring_entries)
+        return 0;
+
+    vcpu->dirty_gfns = mmap(NULL, kvm->dirty_ring_entries * sizeof(struct kvm_dirty_gfn),
+                PROT_READ | PROT_WRITE, MAP_SHARED, vcpu->vcpu_fd,
+                KVM_DIRTY_LOG_PAGE_OFFSET * PAGE_SIZE);
+    if (vcpu->dirty_gfns == MAP_FAILED) {
+        vcpu->dirty_gfns = NULL;
+        perror("unable to mmap dirty ring");
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct kvm_mem_bank *kvm__slot_bank(struct kvm *kvm, uint32_t slot)
+{
+    const struct kvm_mem_table *table = __atomic_load_n(&kvm->mem_table, __ATOMIC_ACQUIRE);
+    unsigned int i;
+
+    for (i = 0; table && i < table->nr; i++)
+        if (table->ranges[i].bank->slot == slot)
+            return table->ranges[i].bank;
+
+    return NULL;
+}
+
+/* Moves the dirty entries of one ring into the bank bitmaps. Needs dirty_lock. */
+static unsigned int dirty_ring_harvest(struct kvm_cpu *vcpu)
+{
+    struct kvm *kvm = vcpu->kvm;
+    uint32_t mask = kvm->dirty_ring_entries - 1;
+    unsigned int count = 0;
+
+    if (!vcpu->dirty_gfns)
+        return 0;
+
+    for (;;) {
+        struct kvm_dirty_gfn *gfn = &vcpu->dirty_gfns[vcpu->dirty_fetch & mask];
+        struct kvm_mem_bank *bank;
+
+        if (!(__atomic_load_n(&gfn->flags, __ATOMIC_ACQUIRE) & KVM_DIRTY_GFN_F_DIRTY))
+            break;
+
+        bank = kvm__slot_bank(kvm, gfn->slot);
+        if (bank && bank->dirty_bitmap && gfn->offset < bank->size / PAGE_SIZE)
+            bank->dirty_bitmap[gfn->offset / BITS_PER_LONG] |= 1UL << (gfn->offset % BITS_PER_LONG);
+
+        /* Hand the entry back to KVM */
+        __atomic_store_n(&gfn->flags, KVM_DIRTY_GFN_F_RESET, __ATOMIC_RELEASE);
+        vcpu->dirty_fetch++;
+        count++;
+    }
+
+    return count;
+}
+
+/* Every page of the bank, and nothing past its end */
+static void dirty_bitmap_fill(struct kvm_mem_bank *bank)
+{
+    uint64_t npages = bank->size / PAGE_SIZE;
+
+    memset(bank->dirty_bitmap, 0xff, npages / BITS_PER_LONG * sizeof(unsigned long));
+    if (npages % BITS_PER_LONG)
+        bank->dirty_bitmap[npages / BITS_PER_LONG] |= (1UL << (npages % BITS_PER_LONG)) - 1;
+}
+
+/*
+ * The host can push past the end of a ring within one exit: PVM, for
+ * one, emulates a batch of guest instructions per exit and only checks
+ * the soft limit after the batch. The overflow overwrites the oldest
+ * entries, whose pages are lost, and lands in slots we had already
+ * harvested. KVM's reset then stops at those slots, right at our fetch
+ * index, and the ring reads as full with nothing in it from then on.
+ *
+ * The slots from dirty_fetch up to the first dirty one are that
+ * overflow: hand them back so KVM's reset index catches up. The lost
+ * pages are unknown, so every logged bank is write protected again and
+ * reported dirty in full. Needs dirty_lock.
+ */
+static int dirty_ring_resync(struct kvm_cpu *vcpu)
+{
+    struct kvm *kvm = vcpu->kvm;
+    uint32_t mask = kvm->dirty_ring_entries - 1;
+    struct kvm_mem_bank *bank;
+    uint32_t gap;
+
+    for (gap = 1; gap < kvm->dirty_ring_entries; gap++) {
+        struct kvm_dirty_gfn *gfn = &vcpu->dirty_gfns[(vcpu->dirty_fetch + gap) & mask];
+
+        if (__atomic_load_n(&gfn->flags, __ATOMIC_ACQUIRE) & KVM_DIRTY_GFN_F_DIRTY)
+            break;
+    }
+    if (gap == kvm->dirty_ring_entries)
+        return -1;
+
+    for (; gap; gap--) {
+        struct kvm_dirty_gfn *gfn = &vcpu->dirty_gfns[vcpu->dirty_fetch++ & mask];
+
+        __atomic_store_n(&gfn->flags, KVM_DIRTY_GFN_F_RESET, __ATOMIC_RELEASE);
+    }
+
+    /* Turning logging back on write protects the whole slot */
+    list_for_each_entry(bank, &kvm->mem_banks, list) {
+        if (!(bank->flags & KVM_MEM_LOG_DIRTY_PAGES))
+            continue;
+
+        bank->flags &= ~KVM_MEM_LOG_DIRTY_PAGES;
+        if (kvm__set_bank_region(kvm, bank) < 0)
+            return -1;
+        bank->flags |= KVM_MEM_LOG_DIRTY_PAGES;
+        if (kvm__set_bank_region(kvm, bank) < 0)
+            return -1;
+
+        dirty_bitmap_fill(bank);
+    }
+
+    return 0;
+}
+
+/*
+ * KVM_EXIT_DIRTY_RING_FULL: the vCPU cannot run again until its ring
+ * drains. Returns -1 if it never will.
+ */
+int kvm_cpu__dirty_ring_full(struct kvm_cpu *vcpu)
+{
+    static int warned;
+    unsigned int count;
+    int ret = 0;
+
+    pthread_mutex_lock(&dirty_lock);
+
+    count = dirty_ring_harvest(vcpu);
+    if (!count) {
+        if (dirty_ring_resync(vcpu) < 0) {
+            fprintf(stderr, "vcpu %lu: dirty ring is full but has nothing to harvest\n",
+                vcpu->cpu_id);
+            ret = -1;
+            goto out;
+        }
+        if (!warned++)
+            fprintf(stderr, "vcpu %lu: dirty ring overflowed in the host, reporting all logged RAM dirty\n",
+                vcpu->cpu_id);
+        count = dirty_ring_harvest(vcpu);
+    }
+
+    if (ioctl(vcpu->kvm->vm_fd, KVM_RESET_DIRTY_RINGS) < 0)
+        perror("KVM_RESET_DIRTY_RINGS ioctl");
+
+out:
+    pthread_mutex_unlock(&dirty_lock);
+    return ret;
+}
+
+/*
+ * Walks a bitmap a word at a time, skipping clean words outright, and
+ * emits each run of set bits, merging runs that cross word boundaries.
+ * The bitmap is cleared as it goes.
+ */
+static int dirty_bitmap_walk(struct kvm *kvm, struct kvm_mem_bank *bank,
+                 dirty_range_fn fn, void *ptr)
+{
+    unsigned long *map = bank->dirty_bitmap;
+    uint64_t nlongs = BITMAP_LONGS(bank->size / PAGE_SIZE);
+    uint64_t run_start = 0, run_len = 0, i;
+    int ret;
+
+    for (i = 0; i < nlongs; i++) {
+        unsigned long w = map[i];
+
+        if (!w)
+            continue;
+        map[i] = 0;
+
+        while (w) {
+            unsigned int start = __builtin_ctzl(w);
+            unsigned long rest = ~(w >> start);
+            unsigned int len = rest ? __builtin_ctzl(rest) : BITS_PER_LONG - start;
+            uint64_t page = i * BITS_PER_LONG + start;
+
+            if (run_len && run_start + run_len == page) {
+                run_len += len;
+            } else {
+                if (run_len) {
+                    ret = fn(kvm, bank->guest_phys_addr + run_start * PAGE_SIZE,
+                         run_len * PAGE_SIZE, ptr);
+                    if (ret)
+                        return ret;
+                }
+                run_start = page;
+                run_len = len;
+            }
+
+            if (start + len >= BITS_PER_LONG)
+                break;
+            w &= ~0UL << (start + len);
+        }
+    }
+
+    if (run_len)
+        return fn(kvm, bank->guest_phys_addr + run_start * PAGE_SIZE,
+              run_len * PAGE_SIZE, ptr);
+
+    return 0;
+}
+
+int kvm__dirty_log_collect(struct kvm *kvm, dirty_range_fn fn, void *ptr)
+{
+    struct kvm_mem_bank *bank;
+    int i, ret = 0, harvested = 0;
+
+    pthread_mutex_lock(&dirty_lock);
+
+    if (kvm->dirty_ring_entries) {
+        for (i = 0; i < kvm->nrcpus; i++)
+            harvested += dirty_ring_harvest(kvm->cpus[i]);
+        if (harvested && ioctl(kvm->vm_fd, KVM_RESET_DIRTY_RINGS) < 0)
+            perror("KVM_RESET_DIRTY_RINGS ioctl");
+    }
+
+    list_for_each_entry(bank, &kvm->mem_banks, list) {
+        if (!(bank->flags & KVM_MEM_LOG_DIRTY_PAGES))
+            continue;
+
+        if (!kvm->dirty_ring_entries) {
+            struct kvm_dirty_log log = {
+                .slot = bank->slot,
+                .dirty_bitmap = bank->dirty_bitmap,
+            };
+
+            if (ioctl(kvm->vm_fd, KVM_GET_DIRTY_LOG, &log) < 0) {
+                ret = -errno;
+                perror("KVM_GET_DIRTY_LOG ioctl");
+                break;
+            }
+        }
+
+        ret = dirty_bitmap_walk(kvm, bank, fn, ptr);
+        if (ret)
+            break;
+    }
+
+    pthread_mutex_unlock(&dirty_lock);
+    return ret;
+}
@@ -0,0 +1,27 @@
+#ifndef KVM__DIRTY_H
+#define KVM__DIRTY_H
+
+#include <stdint.h>
+#include "kvm.h"
+
+/*
+ * Dirty page tracking. Logging is switched on per bank; collecting hands
+ * every run of pages written since the previous collect to @fn as one
+ * guest physical range, lowest address first. A non-zero return from
+ * @fn stops the walk and is passed back.
+ *
+ * Pages come from KVM_GET_DIRTY_LOG, or from the per-vCPU dirty rings
+ * when the VM was created with --dirty-ring. The two are exclusive in KVM.
+ */
+typedef int (*dirty_range_fn)(struct kvm *kvm, uint64_t addr, uint64_t len, void *ptr);
+
+int kvm__dirty_ring_init(struct kvm *kvm, uint32_t entries);
+int kvm_cpu__dirty_ring_map(struct kvm_cpu *vcpu);
+int kvm_cpu__dirty_ring_full(struct kvm_cpu *vcpu);
+
+int kvm__dirty_log_enable(struct kvm *kvm, struct kvm_mem_bank *bank, int enable);
+int kvm__dirty_log_start(struct kvm *kvm);
+int kvm__dirty_log_stop(struct kvm *kvm);
+int kvm__dirty_log_collect(struct kvm *kvm, dirty_range_fn fn, void *ptr);
+
+#endif /* KVM__DIRTY_H */
@@ -26,6 +26,13 @@ struct kbd_state {
      * we store the command here while we wait for the argument
      */
     uint8_t			write_cmd;
+
+    /*
+     * Set while a string I/O batch is running: IRQ line updates are
+     * folded into a single update at the end of the batch.
+     */
+    int			batch;
+    int			batch_lowered;
 };
 
 static struct kbd_state		state;
@@ -59,10 +66,23 @@ static void kbd_update_irq(void)
         mlevel = 1;
     }
 
+    if (state.batch)
+        return;
+
     kvm__irq_line(state.kvm, 1, klevel);
     kvm__irq_line(state.kvm, 12, mlevel);
 }
 
+static void kbd_lower_irq(int irq)
+{
+    if (state.batch) {
+        state.batch_lowered = 1;
+        return;
+    }
+
+    kvm__irq_line(state.kvm, irq, 0);
+}
+
 void mouse_queue(uint8_t c) {
     if (state.mcount >= 128)
         return;
@@ -115,7 +135,7 @@ static void kbd_write_command(struct kvm *kvm, uint8_t val)
         if (!kvm->cpus[0] || kvm->cpus[0]->thread == 0)
             break;
         
-        pthread_kill(kvm->cpus[0]->thread, SIGRTMIN);
+        pthread_kill(kvm->cpus[0]->thread, SIGKVMEXIT);
         break;
     default:
         break;
@@ -200,13 +220,13 @@ uint8_t kbd_read_data(void) {
         /* Keyboard data gets read first */
         ret = state.kq[state.kread++ % 128];
         state.kcount--;
-        kvm__irq_line(state.kvm, 1, 0);
+        kbd_lower_irq(1);
         kbd_update_irq();
     } else if (state.mcount > 0) {
         /* Followed by the mouse */
         ret = state.mq[state.mread++ % 128];
         state.mcount--;
-        kvm__irq_line(state.kvm, 12, 0);
+        kbd_lower_irq(12);
         kbd_update_irq();
     } else {
         i = state.kread - 1;
@@ -259,4 +279,25 @@ static void kbd_io(struct kvm_cpu *vcpu, uint64_t addr, uint8_t *data, uint32_t
         ioport__write8(data, value);
 }
 
+static void kbd_io_bulk(struct kvm_cpu *vcpu, uint64_t addr, uint8_t *data, uint32_t len,
+            uint32_t count, uint8_t is_write, void *ptr)
+{
+    state.batch = 1;
+    state.batch_lowered = 0;
+
+    while (count--) {
+        kbd_io(vcpu, addr, data, len, is_write, ptr);
+        data += len;
+    }
+
+    state.batch = 0;
+
+    /* Re-raise from low so that the guest sees an edge for what is left */
+    if (state.batch_lowered) {
+        kvm__irq_line(state.kvm, 1, 0);
+        kvm__irq_line(state.kvm, 12, 0);
+    }
+    kbd_update_irq();
+}
+
 #endif
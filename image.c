@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "kvm.h"
+#include "image.h"
+
+#define IMAGE_MAGIC		"KVMIMG01"
+#define IMAGE_LOW_MEM		0x100000UL	/* BIOS, tables, setup header, cmdline */
+#define IMAGE_MAX_RANGES	(KVM_MAX_BOOT_RANGES + 1)
+
+#define FNV1A_INIT		0xcbf29ce484222325ULL
+#define FNV1A_PRIME		0x100000001b3ULL
+
+/* What has to be unchanged on disk for an image to be reused */
+struct image_file_sig {
+    uint64_t		dev;
+    uint64_t		ino;
+    uint64_t		size;
+    uint64_t		mtime_ns;
+    uint64_t		ctime_ns;
+};
+
+enum {
+    IMAGE_SIG_SELF,		/* The BIOS and table code are built in */
+    IMAGE_SIG_KERNEL,
+    IMAGE_SIG_INITRD,
+    IMAGE_NR_SIGS,
+};
+
+/* At file offset 0; guest RAM follows at PAGE_SIZE + guest address */
+struct image_header {
+    char		magic[8];
+    uint64_t		key;
+    struct image_file_sig sigs[IMAGE_NR_SIGS];
+    uint64_t		boot_entry;
+    uint32_t		boot_direct;
+    uint32_t		nr_ranges;
+    struct guest_range	ranges[IMAGE_MAX_RANGES];	/* Page aligned */
+};
+
+_Static_assert(sizeof(struct image_header) <= PAGE_SIZE, "image header must fit in one page");
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= FNV1A_PRIME;
+    }
+
+    return hash;
+}
+
+/*
+ * Names the image: which files, the cmdline, and the guest layout that
+ * the e820 map, MP table and SRAT/SLIT describe. File contents are not
+ * hashed, reading a big initrd to hash it costs as much as loading it;
+ * the header's file signatures catch changes instead.
+ */
+static int image_key(struct kvm *kvm, const char *cmdline, int direct_boot, uint64_t *key)
+{
+    const char *files[] = { kvm->kernel_filename, kvm->initrd_filename };
+    const struct kvm_mem_table *table = kvm->mem_table;
+    char path[PATH_MAX];
+    uint64_t hash = FNV1A_INIT;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(files); i++) {
+        if (!realpath(files[i], path))
+            return -1;
+        hash = fnv1a(hash, path, strlen(path) + 1);
+    }
+    hash = fnv1a(hash, cmdline, strlen(cmdline) + 1);
+
+    uint64_t layout[] = {
+        kvm->ram_size, kvm->nrcpus, kvm->nr_sockets, kvm->nr_cores, kvm->nr_threads,
+        kvm->nr_numa_nodes, direct_boot,
+    };
+    hash = fnv1a(hash, layout, sizeof(layout));
+
+    for (i = 0; i < kvm->nr_numa_nodes; i++)
+        hash = fnv1a(hash, &kvm->numa_nodes[i].host_node, sizeof(kvm->numa_nodes[i].host_node));
+    hash = fnv1a(hash, kvm->cpu_node, kvm->nrcpus * sizeof(*kvm->cpu_node));
+
+    for (i = 0; i < table->nr; i++) {
+        uint64_t range[] = {
+            table->ranges[i].guest_phys_addr, table->ranges[i].size, table->ranges[i].bank->node,
+        };
+        hash = fnv1a(hash, range, sizeof(range));
+    }
+
+    *key = hash;
+    return 0;
+}
+
+static int image_file_sig(const char *path, struct image_file_sig *sig)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0)
+        return -1;
+
+    *sig = (struct image_file_sig) {
+        .dev		= st.st_dev,
+        .ino		= st.st_ino,
+        .size		= st.st_size,
+        .mtime_ns	= st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec,
+        .ctime_ns	= st.st_ctim.tv_sec * 1000000000ULL + st.st_ctim.tv_nsec,
+    };
+    return 0;
+}
+
+static int image_sigs(struct kvm *kvm, struct image_file_sig *sigs)
+{
+    if (image_file_sig("/proc/self/exe", &sigs[IMAGE_SIG_SELF]) < 0 ||
+        image_file_sig(kvm->kernel_filename, &sigs[IMAGE_SIG_KERNEL]) < 0 ||
+        image_file_sig(kvm->initrd_filename, &sigs[IMAGE_SIG_INITRD]) < 0)
+        return -1;
+
+    return 0;
+}
+
+static void image_path(char *buf, size_t size, const char *dir, uint64_t key)
+{
+    snprintf(buf, size, "%s/%016llx.img", dir, (unsigned long long)key);
+}
+
+static ssize_t pwrite_in_full(int fd, const void *buf, size_t count, off_t offset)
+{
+    const char *p = buf;
+
+    while (count > 0) {
+        ssize_t nr = pwrite(fd, p, count, offset);
+
+        if (nr < 0 && errno == EINTR)
+            continue;
+        if (nr <= 0)
+            return -1;
+
+        count -= nr;
+        p += nr;
+        offset += nr;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns 0 with the boot RAM in place, or -1 if the caller has to set
+ * it up itself: no image, a stale one, or one that cannot be read.
+ */
+int kvm__image_cache_load(struct kvm *kvm, const char *dir, const char *cmdline, int direct_boot)
+{
+    struct image_file_sig sigs[IMAGE_NR_SIGS];
+    struct image_header hdr;
+    char path[PATH_MAX];
+    struct stat st;
+    uint64_t key;
+    unsigned int i;
+    int fd, ret = -1;
+
+    if (image_key(kvm, cmdline, direct_boot, &key) < 0 || image_sigs(kvm, sigs) < 0)
+        return -1;
+
+    image_path(path, sizeof(path), dir, key);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (pread_in_full(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fstat(fd, &st) < 0)
+        goto out;
+    if (memcmp(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic)) || hdr.key != key ||
+        hdr.nr_ranges > IMAGE_MAX_RANGES)
+        goto out;
+    if (memcmp(hdr.sigs, sigs, sizeof(sigs)))
+        goto out;
+
+    /* A mapping past EOF would SIGBUS the guest, so check it all up front */
+    for (i = 0; i < hdr.nr_ranges; i++) {
+        struct guest_range *r = &hdr.ranges[i];
+
+        if (PAGE_SIZE + r->addr + r->len > (uint64_t)st.st_size ||
+            !guest_flat_to_host_range(kvm, r->addr, r->len))
+            goto out;
+    }
+
+    for (i = 0; i < hdr.nr_ranges; i++) {
+        struct guest_range *r = &hdr.ranges[i];
+
+        if (guest_map_file(kvm, r->addr, fd, PAGE_SIZE + r->addr, r->len) == 0)
+            continue;
+        if (pread_in_full(fd, guest_flat_to_host(kvm, r->addr), r->len, PAGE_SIZE + r->addr) !=
+            (ssize_t)r->len) {
+            fprintf(stderr, "Unable to read boot image %s\n", path);
+            goto out;
+        }
+    }
+
+    kvm->boot_direct = hdr.boot_direct;
+    kvm->boot_entry = hdr.boot_entry;
+    ret = 0;
+
+out:
+    close(fd);
+    return ret;
+}
+
+/*
+ * Written under a temporary name and renamed over the old image, so
+ * a guest that has the old one mapped keeps seeing it unchanged.
+ */
+int kvm__image_cache_save(struct kvm *kvm, const char *dir, const char *cmdline, int direct_boot)
+{
+    struct image_header hdr;
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    unsigned int i;
+    int fd;
+
+    /* More vmlinux segments than the header has room for */
+    if (kvm->nr_boot_ranges > KVM_MAX_BOOT_RANGES)
+        return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+    if (image_key(kvm, cmdline, direct_boot, &hdr.key) < 0 || image_sigs(kvm, hdr.sigs) < 0)
+        return -1;
+    hdr.boot_entry = kvm->boot_entry;
+    hdr.boot_direct = kvm->boot_direct;
+
+    hdr.ranges[hdr.nr_ranges++] = (struct guest_range) { .addr = 0, .len = IMAGE_LOW_MEM };
+    for (i = 0; i < kvm->nr_boot_ranges; i++) {
+        uint64_t start = kvm->boot_ranges[i].addr & ~(PAGE_SIZE - 1);
+        uint64_t end = (kvm->boot_ranges[i].addr + kvm->boot_ranges[i].len + PAGE_SIZE - 1) &
+                   ~(PAGE_SIZE - 1);
+
+        if (!guest_flat_to_host_range(kvm, start, end - start))
+            return -1;
+        hdr.ranges[hdr.nr_ranges++] = (struct guest_range) { .addr = start, .len = end - start };
+    }
+
+    image_path(path, sizeof(path), dir, hdr.key);
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        return -1;
+
+    /* The gaps between ranges stay holes */
+    for (i = 0; i < hdr.nr_ranges; i++) {
+        struct guest_range *r = &hdr.ranges[i];
+
+        if (pwrite_in_full(fd, guest_flat_to_host(kvm, r->addr), r->len, PAGE_SIZE + r->addr) < 0)
+            goto fail;
+    }
+    if (pwrite_in_full(fd, &hdr, sizeof(hdr), 0) < 0 || fchmod(fd, 0644) < 0)
+        goto fail;
+
+    close(fd);
+    if (rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+
+fail:
+    close(fd);
+    unlink(tmp);
+    return -1;
+}
@@ -0,0 +1,20 @@
+#ifndef KVM__IMAGE_H
+#define KVM__IMAGE_H
+
+#include "kvm.h"
+
+/*
+ * Boot image cache. After a normal boot setup, the guest RAM it wrote
+ * (the low 1M with the BIOS, e820, MP/ACPI tables, setup header and
+ * cmdline, then the kernel and the initrd) is saved to a sparse file in
+ * @dir, at file offset PAGE_SIZE + guest physical address. Later boots
+ * with the same kernel, initrd, cmdline and guest layout map that file
+ * in instead of doing the setup again.
+ *
+ * An entry goes stale as soon as the kernel, the initrd or this binary
+ * changes on disk; the next save replaces it.
+ */
+int kvm__image_cache_load(struct kvm *kvm, const char *dir, const char *cmdline, int direct_boot);
+int kvm__image_cache_save(struct kvm *kvm, const char *dir, const char *cmdline, int direct_boot);
+
+#endif /* KVM__IMAGE_H */
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/kvm.h>
+#include "kvm.h"
+#include "list.h"
+#include "ioeventfd.h"
+
+#define IOEVENTFD_MAX_EVENTS	20
+
+struct ioevent {
+    struct list_head	list;
+    uint64_t		addr;
+    uint32_t		len;
+    uint64_t		datamatch;
+    unsigned int		flags;
+    int			fd;
+    mmio_handler_fn		fn;
+    void			*ptr;
+};
+
+static LIST_HEAD(used_ioevents);
+static pthread_mutex_t ioevent_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t ioevent_thread;
+static int epoll_fd = -1;
+
+static struct ioevent *ioevent_find_fd(int fd) {
+    struct ioevent *ioevent;
+
+    list_for_each_entry(ioevent, &used_ioevents, list)
+        if (ioevent->fd == fd)
+            return ioevent;
+
+    return NULL;
+}
+
+static void ioevent_handle(int fd) {
+    struct ioevent *ioevent;
+    uint64_t count;
+    uint8_t data[8];
+
+    if (read(fd, &count, sizeof(count)) < 0)
+        return;
+
+    /*
+     * The event may have been removed while we were waiting, so look it
+     * up again instead of trusting the epoll cookie.
+     */
+    pthread_mutex_lock(&ioevent_lock);
+    ioevent = ioevent_find_fd(fd);
+    if (ioevent) {
+        for (int i = 0; i < 8; i++)
+            data[i] = ioevent->datamatch >> (i * 8);
+
+        ioevent->fn(NULL, ioevent->addr, data, ioevent->len, 1, ioevent->ptr);
+    }
+    pthread_mutex_unlock(&ioevent_lock);
+}
+
+static void *ioeventfd__thread(void *param) {
+    struct epoll_event events[IOEVENTFD_MAX_EVENTS];
+
+    kvm__set_thread_name("kvm-ioeventfd");
+
+    while (1) {
+        int nfds, i;
+
+        nfds = epoll_wait(epoll_fd, events, IOEVENTFD_MAX_EVENTS, -1);
+        if (nfds < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (i = 0; i < nfds; i++)
+            ioevent_handle(events[i].data.fd);
+    }
+
+    return NULL;
+}
+
+/* Must be called with ioevent_lock held. */
+static int ioeventfd__start(void) {
+    if (epoll_fd >= 0)
+        return 0;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        return -errno;
+
+    if (pthread_create(&ioevent_thread, NULL, ioeventfd__thread, NULL) != 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+static int ioeventfd__kvm(struct kvm *kvm, struct ioevent *ioevent, int deassign) {
+    struct kvm_ioeventfd kvm_ioevent = (struct kvm_ioeventfd) {
+        .addr		= ioevent->addr,
+        .len		= ioevent->len,
+        .datamatch	= ioevent->datamatch,
+        .fd		= ioevent->fd,
+    };
+
+    if (!trap_is_mmio(ioevent->flags))
+        kvm_ioevent.flags |= KVM_IOEVENTFD_FLAG_PIO;
+    if (ioevent->flags & IOTRAP_DATAMATCH)
+        kvm_ioevent.flags |= KVM_IOEVENTFD_FLAG_DATAMATCH;
+    if (deassign)
+        kvm_ioevent.flags |= KVM_IOEVENTFD_FLAG_DEASSIGN;
+
+    if (ioctl(kvm->vm_fd, KVM_IOEVENTFD, &kvm_ioevent) < 0)
+        return -errno;
+
+    return 0;
+}
+
+int ioeventfd__add(struct kvm *kvm, uint64_t addr, uint32_t len, uint64_t datamatch,
+           unsigned int flags, mmio_handler_fn fn, void *ptr) {
+    struct epoll_event epoll_event;
+    struct ioevent *ioevent;
+    int r;
+
+    ioevent = malloc(sizeof(*ioevent));
+    if (ioevent == NULL)
+        return -ENOMEM;
+
+    *ioevent = (struct ioevent) {
+        .addr		= addr,
+        .len		= len,
+        .datamatch	= (flags & IOTRAP_DATAMATCH) ? datamatch : 0,
+        .flags		= flags,
+        .fn		= fn,
+        .ptr		= ptr,
+    };
+
+    ioevent->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ioevent->fd < 0) {
+        r = -errno;
+        goto free;
+    }
+
+    pthread_mutex_lock(&ioevent_lock);
+
+    r = ioeventfd__kvm(kvm, ioevent, 0);
+    if (r < 0)
+        goto unlock;
+
+    /* Without a handler the write is simply swallowed by KVM */
+    if (fn) {
+        r = ioeventfd__start();
+        if (r < 0)
+            goto deassign;
+
+        epoll_event = (struct epoll_event) {
+            .events		= EPOLLIN,
+            .data.fd	= ioevent->fd,
+        };
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ioevent->fd, &epoll_event) < 0) {
+            r = -errno;
+            goto deassign;
+        }
+    }
+
+    list_add_tail(&ioevent->list, &used_ioevents);
+    pthread_mutex_unlock(&ioevent_lock);
+
+    return 0;
+
+deassign:
+    ioeventfd__kvm(kvm, ioevent, 1);
+unlock:
+    pthread_mutex_unlock(&ioevent_lock);
+    close(ioevent->fd);
+free:
+    free(ioevent);
+    return r;
+}
+
+int ioeventfd__del(struct kvm *kvm, uint64_t addr, uint64_t datamatch, unsigned int flags) {
+    struct ioevent *ioevent;
+
+    if (!(flags & IOTRAP_DATAMATCH))
+        datamatch = 0;
+
+    pthread_mutex_lock(&ioevent_lock);
+    list_for_each_entry(ioevent, &used_ioevents, list) {
+        if (ioevent->addr == addr && ioevent->datamatch == datamatch &&
+            trap_is_mmio(ioevent->flags) == trap_is_mmio(flags))
+            break;
+    }
+
+    if (&ioevent->list == &used_ioevents) {
+        pthread_mutex_unlock(&ioevent_lock);
+        return 0;
+    }
+
+    ioeventfd__kvm(kvm, ioevent, 1);
+    if (ioevent->fn)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ioevent->fd, NULL);
+    list_del(&ioevent->list);
+    pthread_mutex_unlock(&ioevent_lock);
+
+    close(ioevent->fd);
+    free(ioevent);
+
+    return 1;
+}
@@ -0,0 +1,18 @@
+#ifndef KVM__IOEVENTFD_H
+#define KVM__IOEVENTFD_H
+
+#include <stdint.h>
+#include "kvm.h"
+#include "mmio.h"
+
+/*
+ * Writes to an ioeventfd-backed trap complete inside KVM: the vCPU only
+ * signals an eventfd and carries on. The handler then runs on the
+ * ioeventfd worker thread with a NULL vcpu, and @data holds the datamatch
+ * value (zero when the trap matches any value).
+ */
+int ioeventfd__add(struct kvm *kvm, uint64_t addr, uint32_t len, uint64_t datamatch,
+           unsigned int flags, mmio_handler_fn fn, void *ptr);
+int ioeventfd__del(struct kvm *kvm, uint64_t addr, uint64_t datamatch, unsigned int flags);
+
+#endif /* KVM__IOEVENTFD_H */
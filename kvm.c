@@ -10,11 +10,16 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
 #include <asm/bootparam.h>
 #include <termios.h>
 #include <signal.h>
 #include <errno.h>
 #include <limits.h>
+#include <getopt.h>
+#include <sched.h>
+#include <elf.h>
 #include "kvm.h"
 #include "rbtree.h"
 #include "mmio.h"
@@ -22,44 +27,113 @@
 #include "devices.h"
 #include "term.h"
 #include "mptable.h"
+#include "acpi.h"
+#include "ioeventfd.h"
+#include "stats.h"
+#include "control.h"
+#include "dirty.h"
+#include "wss.h"
+#include "zero.h"
+#include "image.h"
 
 #define KVM_DEV "/dev/kvm"
 
+/* Both encode the hugepage size the same way; glibc only has the MAP_ one */
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT MAP_HUGE_SHIFT
+#endif
+
 void serial8250__update_consoles(struct kvm *kvm);
 int serial8250__init(struct kvm *kvm);
-static pthread_mutex_t mmio_lock;
+static pthread_mutex_t mmio_lock = PTHREAD_MUTEX_INITIALIZER;
 static char kern_cmdline[2048] = "noapic noacpi pci=conf1 reboot=k panic=1 i8042.direct=1 i8042.dumbkbd=1 i8042.nopnp=1 earlyprintk=serial i8042.noaux=1 console=ttyS0 root=/dev/vda rw ";
 static const char *BZIMAGE_MAGIC = "HdrS";
 static struct rb_root pio_tree = RB_ROOT;
+static struct mmio_table *pio_table;
+static struct rb_root mmio_tree = RB_ROOT;
+static struct mmio_table *mmio_table;
+
+/*
+ * The exit path never takes mmio_lock. Writers publish a new table and
+ * bump mmio_epoch; every vCPU records the epoch it saw while it is inside
+ * a lookup. Whatever was retired at epoch N can be freed once no vCPU is
+ * still running with an epoch older than N.
+ */
+struct mmio_retired {
+    struct mmio_retired	*next;
+    uint64_t		epoch;
+    struct mmio_table	*table;
+    struct mmio_mapping	*mmio;
+};
+
+static uint64_t mmio_epoch = 1;
+static struct mmio_retired *mmio_retired;
 
 struct kvm_cpu *kvm_cpu__arch_init(struct kvm *kvm, unsigned long cpu_id) {
 
-    struct kvm_cpu *vcpu = malloc(sizeof(struct kvm_cpu));
-    int mmap_size;
-
-    vcpu->kvm = kvm;
+    struct kvm_cpu *vcpu = calloc(1, sizeof(struct kvm_cpu));
 
     if (!vcpu)
         return NULL;
 
+    vcpu->kvm = kvm;
     vcpu->cpu_id = cpu_id;
-    vcpu->vcpu_fd = ioctl(vcpu->kvm->vm_fd, KVM_CREATE_VCPU, cpu_id);
-    if (vcpu->vcpu_fd < 0)
+    vcpu->apic_id = kvm__cpu_apic_id(kvm, cpu_id);
+    vcpu->vcpu_fd = ioctl(vcpu->kvm->vm_fd, KVM_CREATE_VCPU, vcpu->apic_id);
+    if (vcpu->vcpu_fd < 0) {
         perror("KVM_CREATE_VCPU ioctl");
+        free(vcpu);
+        return NULL;
+    }
 
-    mmap_size = ioctl(vcpu->kvm->sys_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
-    if (mmap_size < 0)
-        perror("KVM_GET_VCPU_MMAP_SIZE ioctl");
-
-    vcpu->kvm_run = mmap(NULL, mmap_size, PROT_READ|PROT_WRITE, MAP_SHARED, vcpu->vcpu_fd, 0);
-    if (vcpu->kvm_run == MAP_FAILED)
+    vcpu->kvm_run = mmap(NULL, kvm->vcpu_mmap_size, PROT_READ|PROT_WRITE, MAP_SHARED, vcpu->vcpu_fd, 0);
+    if (vcpu->kvm_run == MAP_FAILED) {
         perror("unable to mmap vcpu fd");
+        close(vcpu->vcpu_fd);
+        free(vcpu);
+        return NULL;
+    }
 
+    if (kvm_cpu__dirty_ring_map(vcpu) < 0) {
+        munmap(vcpu->kvm_run, kvm->vcpu_mmap_size);
+        close(vcpu->vcpu_fd);
+        free(vcpu);
+        return NULL;
+    }
 
     return vcpu;
 }
 
+struct kvm_cpu_init_work {
+    struct kvm *kvm;
+    int next;		/* Next vCPU index to create */
+    int failed;
+};
+
+static void *kvm_cpu__init_worker(void *param)
+{
+    struct kvm_cpu_init_work *work = param;
+    struct kvm *kvm = work->kvm;
+    int i;
+
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < kvm->nrcpus) {
+        kvm->cpus[i] = kvm_cpu__arch_init(kvm, i);
+        if (!kvm->cpus[i])
+            __atomic_store_n(&work->failed, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static int kvm_cpu__init_cpuid(struct kvm *kvm);
+
+/* Big guests spend most of their startup in KVM_CREATE_VCPU and the mmap */
+#define KVM_CPU_INIT_THREADS 8
+
 int kvm_cpu__init(struct kvm *kvm) {
+    struct kvm_cpu_init_work work = { .kvm = kvm };
+    pthread_t workers[KVM_CPU_INIT_THREADS];
+    int nr_workers, coalesced_offset, i;
 
     // Set number of CPUS
     kvm->cpus = calloc(kvm->nrcpus + 1, sizeof(void *));
@@ -70,26 +144,59 @@ int kvm_cpu__init(struct kvm *kvm) {
         return -1;
     }
 
-    for (int i = 0; i < kvm->nrcpus; i++)
+    kvm->vcpu_mmap_size = ioctl(kvm->sys_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+    if (kvm->vcpu_mmap_size < 0) {
+        perror("KVM_GET_VCPU_MMAP_SIZE ioctl");
+        return -1;
+    }
+
+    if (kvm_cpu__init_cpuid(kvm) < 0)
+        return -1;
+
+    nr_workers = kvm->nrcpus / 4;
+    if (nr_workers > KVM_CPU_INIT_THREADS)
+        nr_workers = KVM_CPU_INIT_THREADS;
+
+    /* The caller does a share of the work too */
+    for (i = 0; i < nr_workers; i++) {
+        if (pthread_create(&workers[i], NULL, kvm_cpu__init_worker, &work) != 0)
+            break;
+    }
+    nr_workers = i;
+
+    kvm_cpu__init_worker(&work);
+
+    for (i = 0; i < nr_workers; i++)
+        pthread_join(workers[i], NULL);
+
+    if (work.failed)
     {
-        kvm->cpus[i] = kvm_cpu__arch_init(kvm, i);
-        if (!kvm->cpus[i])
-        {
-            printf("unable to initialize KVM VCPU\n");
-            goto fail_alloc;
-        }
+        printf("unable to initialize KVM VCPU\n");
+        goto fail_alloc;
     }
 
+    /* The coalesced ring is one page per VM, reachable from any vCPU mapping */
+    coalesced_offset = ioctl(kvm->sys_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+    if (coalesced_offset > 0)
+        kvm->coalesced_ring = (void *)kvm->cpus[0]->kvm_run + coalesced_offset * PAGE_SIZE;
+
     return 0;
 
 fail_alloc:
-    for (int i = 0; i < kvm->nrcpus; i++)
+    for (i = 0; i < kvm->nrcpus; i++) {
+        if (!kvm->cpus[i])
+            continue;
+        munmap(kvm->cpus[i]->kvm_run, kvm->vcpu_mmap_size);
+        close(kvm->cpus[i]->vcpu_fd);
         free(kvm->cpus[i]);
+        kvm->cpus[i] = NULL;
+    }
 
     return -1;
 }
 
-void filter_cpuid(struct kvm_cpuid2 *kvm_cpuid, int cpu_id) {
+/* VM-wide CPUID filtering; the per-vCPU APIC ID is patched in later */
+void filter_cpuid(struct kvm *kvm, struct kvm_cpuid2 *kvm_cpuid) {
     unsigned int i;
 
     for (i = 0; i < kvm_cpuid->nent; i++) {
@@ -97,12 +204,50 @@ void filter_cpuid(struct kvm_cpuid2 *kvm_cpuid, int cpu_id) {
 
         switch (entry->function) {
         case 1:
-            entry->ebx &= ~(0xff << 24);
-            entry->ebx |= cpu_id << 24;
+            /* Addressable logical processors per package */
+            entry->ebx &= ~(0xff << 16);
+            entry->ebx |= (1U << kvm->socket_shift) << 16;
+            if (kvm->socket_shift)
+                entry->edx |= (1 << 28);	/* HTT */
+            else
+                entry->edx &= ~(1 << 28);
             /* Set X86_FEATURE_HYPERVISOR */
             if (entry->index == 0)
                 entry->ecx |= (1 << 31);
             break;
+        case 4: {
+            unsigned int level = (entry->eax >> 5) & 0x7;
+
+            if (!(entry->eax & 0x1f))	/* No more caches */
+                break;
+
+            /* Cores per package, and threads sharing this cache */
+            entry->eax &= ~(0x3f << 26);
+            entry->eax |= ((1U << (kvm->socket_shift - kvm->core_shift)) - 1) << 26;
+            entry->eax &= ~(0xfff << 14);
+            if (level <= 2)
+                entry->eax |= ((1U << kvm->core_shift) - 1) << 14;
+            else
+                entry->eax |= ((1U << kvm->socket_shift) - 1) << 14;
+            break;
+        }
+        case 0xb:
+        case 0x1f:
+            /* Extended topology: SMT level, then core level */
+            if (entry->index == 0) {
+                entry->eax = kvm->core_shift;
+                entry->ebx = kvm->nr_threads;
+                entry->ecx = (1 << 8) | entry->index;
+            } else if (entry->index == 1) {
+                entry->eax = kvm->socket_shift;
+                entry->ebx = kvm->nr_cores * kvm->nr_threads;
+                entry->ecx = (2 << 8) | entry->index;
+            } else {
+                entry->eax = 0;
+                entry->ebx = 0;
+                entry->ecx = entry->index;
+            }
+            break;
         case 6:
             entry->ecx = entry->ecx & ~(1 << 3);
             break;
@@ -131,17 +276,63 @@ void filter_cpuid(struct kvm_cpuid2 *kvm_cpuid, int cpu_id) {
     }
 }
 
+static int kvm_cpu__init_cpuid(struct kvm *kvm) {
+    struct kvm_cpuid2 *kvm_cpuid = NULL;
+    unsigned int nent = 100;
+
+    /* Grow the buffer until everything the host supports fits */
+    for (;;) {
+        kvm_cpuid = calloc(1, sizeof(*kvm_cpuid) +
+                    nent * sizeof(*kvm_cpuid->entries));
+        if (!kvm_cpuid)
+            return -1;
+
+        kvm_cpuid->nent = nent;
+        if (ioctl(kvm->sys_fd, KVM_GET_SUPPORTED_CPUID, kvm_cpuid) == 0)
+            break;
+
+        free(kvm_cpuid);
+        if (errno != E2BIG) {
+            perror("KVM_GET_SUPPORTED_CPUID failed");
+            return -1;
+        }
+        nent *= 2;
+    }
+
+    filter_cpuid(kvm, kvm_cpuid);
+    kvm->cpuid = kvm_cpuid;
+
+    return 0;
+}
+
 void kvm_cpu__setup_cpuid(struct kvm_cpu *vcpu) {
+    struct kvm_cpuid2 *tmpl = vcpu->kvm->cpuid;
+    size_t size = sizeof(*tmpl) + tmpl->nent * sizeof(*tmpl->entries);
     struct kvm_cpuid2 *kvm_cpuid;
+    unsigned int i;
 
-    kvm_cpuid = calloc(1, sizeof(*kvm_cpuid) +
-                100 * sizeof(*kvm_cpuid->entries));
+    kvm_cpuid = malloc(size);
+    if (!kvm_cpuid)
+        return;
 
-    kvm_cpuid->nent = 100;
-    if (ioctl(vcpu->kvm->sys_fd, KVM_GET_SUPPORTED_CPUID, kvm_cpuid) < 0)
-        perror("KVM_GET_SUPPORTED_CPUID failed");
+    memcpy(kvm_cpuid, tmpl, size);
 
-    filter_cpuid(kvm_cpuid, vcpu->cpu_id);
+    for (i = 0; i < kvm_cpuid->nent; i++) {
+        struct kvm_cpuid_entry2 *entry = &kvm_cpuid->entries[i];
+
+        switch (entry->function) {
+        case 1:
+            entry->ebx &= ~(0xff << 24);
+            entry->ebx |= vcpu->apic_id << 24;
+            break;
+        case 0xb:
+        case 0x1f:
+            entry->edx = vcpu->apic_id;
+            break;
+        default:
+            break;
+        }
+    }
 
     if (ioctl(vcpu->vcpu_fd, KVM_SET_CPUID2, kvm_cpuid) < 0)
         perror("KVM_SET_CPUID2 failed");
@@ -193,6 +384,10 @@ static void kvm_cpu__setup_regs(struct kvm_cpu *vcpu) {
 
 void kvm_cpu__reset_vcpu(struct kvm_cpu *vcpu) {
     kvm_cpu__setup_cpuid(vcpu);
+    if (vcpu->cpu_id == 0 && vcpu->kvm->boot_direct) {
+        kvm_cpu__setup_long_mode(vcpu);
+        return;
+    }
     kvm_cpu__setup_sregs(vcpu);
     kvm_cpu__setup_regs(vcpu);
 }
@@ -263,19 +458,6 @@ int rb_int_insert(struct rb_root *root, struct rb_int_node *i_node) {
     return 0;
 }
 
-static struct mmio_mapping *mmio_search(struct rb_root *root, uint64_t addr, uint64_t len) {
-    struct rb_int_node *node;
-
-    if (addr + len <= addr)
-        return NULL;
-
-    node = rb_int_search_range(root, addr, addr + len);
-    if (node == NULL)
-        return NULL;
-
-    return mmio_node(node);
-}
-
 static struct mmio_mapping *mmio_search_single(struct rb_root *root, uint64_t addr) {
     struct rb_int_node *node;
 
@@ -291,47 +473,253 @@ static void mmio_remove(struct rb_root *root, struct mmio_mapping *data) {
 }
 
 static void mmio_deregister(struct kvm *kvm, struct rb_root *root, struct mmio_mapping *mmio) {
-    struct kvm_coalesced_mmio_zone zone = (struct kvm_coalesced_mmio_zone) {
-        .addr	= rb_int_start(&mmio->node),
-        .size	= 1,
-    };
-    ioctl(kvm->vm_fd, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+    if (mmio->flags & IOTRAP_COALESCE)
+        kvm__coalesce_iotrap(kvm, mmio->node.low, mmio->node.high - mmio->node.low,
+                     mmio->flags, 0);
 
     mmio_remove(root, mmio);
-    free(mmio);
 }
 
 static int mmio_insert(struct rb_root *root, struct mmio_mapping *data) {
     return rb_int_insert(root, &data->node);
 }
 
-static struct mmio_mapping *mmio_get(struct rb_root *root, uint64_t phys_addr, uint32_t len) {
-    struct mmio_mapping *mmio;
+static struct mmio_mapping *pio_empty_page[PIO_PAGE_SIZE];
 
-    pthread_mutex_lock(&mmio_lock);
-    mmio = mmio_search(root, phys_addr, len);
-    if (mmio)
-        mmio->refcount++;
-    pthread_mutex_unlock(&mmio_lock);
+/*
+ * Add or remove a coalesced zone: guest writes inside it are queued in
+ * kvm->coalesced_ring instead of exiting, and replayed in order before
+ * the next exit is handled. Returns -ENOTSUP if KVM cannot coalesce on
+ * this bus.
+ */
+int kvm__coalesce_iotrap(struct kvm *kvm, uint64_t phys_addr, uint64_t phys_addr_len,
+             unsigned int flags, int enable) {
+    struct kvm_coalesced_mmio_zone zone = (struct kvm_coalesced_mmio_zone) {
+        .addr	= phys_addr,
+        .size	= phys_addr_len,
+        .pio	= !trap_is_mmio(flags),
+    };
+    int cap = trap_is_mmio(flags) ? KVM_CAP_COALESCED_MMIO : KVM_CAP_COALESCED_PIO;
+
+    if (ioctl(kvm->sys_fd, KVM_CHECK_EXTENSION, cap) <= 0)
+        return -ENOTSUP;
+
+    if (ioctl(kvm->vm_fd, enable ? KVM_REGISTER_COALESCED_MMIO : KVM_UNREGISTER_COALESCED_MMIO,
+          &zone) < 0)
+        return -errno;
+
+    return 0;
+}
+
+static struct mmio_table *mmio_table_build(struct rb_root *root) {
+    struct mmio_table *table;
+    struct mmio_mapping **page;
+    struct rb_node *node;
+    unsigned int nr = 0, nr_pages = 0, i;
+    uint64_t last_page = UINT64_MAX;
+
+    for (node = rb_first(root); node; node = rb_next(node)) {
+        struct rb_int_node *range = rb_int(node);
+        uint64_t first, last;
+
+        nr++;
+        if (range->low >= 0x10000 || range->high <= range->low)
+            continue;
+
+        /* Ranges are sorted and disjoint, so only the first page can be shared */
+        first = range->low >> PIO_PAGE_SHIFT;
+        last = (range->high < 0x10000 ? range->high - 1 : 0xffff) >> PIO_PAGE_SHIFT;
+        nr_pages += last - first + 1 - (first == last_page);
+        last_page = last;
+    }
+
+    table = malloc(sizeof(*table) + nr * sizeof(table->maps[0]) +
+               nr_pages * sizeof(pio_empty_page));
+    if (table == NULL)
+        return NULL;
+
+    for (i = 0; i < PIO_NR_PAGES; i++)
+        table->pio[i] = pio_empty_page;
+
+    /* In-order walk, so the table comes out sorted by start address */
+    table->nr = 0;
+    page = (struct mmio_mapping **)&table->maps[nr];
+    for (node = rb_first(root); node; node = rb_next(node)) {
+        struct mmio_mapping *mmio = mmio_node(rb_int(node));
+        uint64_t port;
+
+        table->maps[table->nr++] = mmio;
+        if (mmio->node.low >= 0x10000)
+            continue;
+
+        for (port = mmio->node.low; port < mmio->node.high && port < 0x10000; port++) {
+            struct mmio_mapping ***slot = &table->pio[port >> PIO_PAGE_SHIFT];
+
+            if (*slot == pio_empty_page) {
+                *slot = page;
+                memset(page, 0, sizeof(pio_empty_page));
+                page += PIO_PAGE_SIZE;
+            }
+            (*slot)[port & PIO_PAGE_MASK] = mmio;
+        }
+    }
+
+    return table;
+}
+
+static struct mmio_mapping *mmio_table_search(struct mmio_table *table, uint64_t addr, uint64_t len) {
+    unsigned int lo = 0, hi;
+
+    if (table == NULL || addr + len <= addr)
+        return NULL;
+
+    hi = table->nr;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        struct mmio_mapping *mmio = table->maps[mid];
+
+        if (addr < mmio->node.low)
+            hi = mid;
+        else if (mmio->node.high <= addr)
+            lo = mid + 1;
+        else
+            return (addr + len <= mmio->node.high) ? mmio : NULL;
+    }
+
+    return NULL;
+}
+
+static uint64_t mmio_oldest_reader(struct kvm *kvm) {
+    uint64_t oldest = UINT64_MAX;
+
+    if (kvm->cpus == NULL)
+        return oldest;
+
+    for (int i = 0; i < kvm->nrcpus; i++) {
+        struct kvm_cpu *vcpu = kvm->cpus[i];
+        uint64_t epoch;
+
+        if (vcpu == NULL)
+            continue;
+
+        epoch = __atomic_load_n(&vcpu->mmio_epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest)
+            oldest = epoch;
+    }
+
+    return oldest;
+}
+
+/* Must be called with mmio_lock held. */
+static void mmio_reclaim(struct kvm *kvm) {
+    struct mmio_retired **pp = &mmio_retired, *r;
+    uint64_t oldest = mmio_oldest_reader(kvm);
+
+    while ((r = *pp) != NULL) {
+        if (r->epoch > oldest) {
+            pp = &r->next;
+            continue;
+        }
+
+        *pp = r->next;
+        free(r->table);
+        free(r->mmio);
+        free(r);
+    }
+}
+
+/*
+ * Rebuild the lookup table of @root, publish it and retire the previous
+ * table together with @mmio (if any). Must be called with mmio_lock held.
+ */
+static int mmio_update(struct kvm *kvm, struct rb_root *root, struct mmio_table **tablep,
+               struct mmio_mapping *mmio) {
+    struct mmio_retired *r;
+    struct mmio_table *table;
+
+    r = malloc(sizeof(*r));
+    if (r == NULL)
+        return -ENOMEM;
+
+    table = mmio_table_build(root);
+    if (table == NULL) {
+        free(r);
+        return -ENOMEM;
+    }
+
+    r->table = __atomic_exchange_n(tablep, table, __ATOMIC_SEQ_CST);
+    r->mmio = mmio;
+    r->epoch = __atomic_add_fetch(&mmio_epoch, 1, __ATOMIC_SEQ_CST);
+    r->next = mmio_retired;
+    __atomic_store_n(&mmio_retired, r, __ATOMIC_RELEASE);
+
+    mmio_reclaim(kvm);
+
+    return 0;
+}
+
+static void mmio_put(struct kvm_cpu *vcpu) {
+    __atomic_store_n(&vcpu->mmio_epoch, 0, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&mmio_retired, __ATOMIC_RELAXED) == NULL)
+        return;
+
+    if (pthread_mutex_trylock(&mmio_lock) == 0) {
+        mmio_reclaim(vcpu->kvm);
+        pthread_mutex_unlock(&mmio_lock);
+    }
+}
+
+static inline void mmio_read_lock(struct kvm_cpu *vcpu) {
+    __atomic_store_n(&vcpu->mmio_epoch,
+             __atomic_load_n(&mmio_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Lockless lookups for the exit path. On success the caller is inside a
+ * read section and must call mmio_put() once it is done with the mapping.
+ */
+static struct mmio_mapping *pio_get(struct kvm_cpu *vcpu, uint16_t port, uint32_t len) {
+    struct mmio_mapping *mmio = NULL;
+    struct mmio_table *table;
+
+    mmio_read_lock(vcpu);
+
+    table = __atomic_load_n(&pio_table, __ATOMIC_SEQ_CST);
+    if (table)
+        mmio = table->pio[port >> PIO_PAGE_SHIFT][port & PIO_PAGE_MASK];
+
+    if (mmio == NULL || port + len > mmio->node.high) {
+        mmio_put(vcpu);
+        return NULL;
+    }
 
     return mmio;
 }
 
-static void mmio_put(struct kvm *kvm, struct rb_root *root, struct mmio_mapping *mmio)
-{
-    pthread_mutex_lock(&mmio_lock);
-    mmio->refcount--;
-    if (mmio->remove && mmio->refcount == 0)
-        mmio_deregister(kvm, root, mmio);
-    pthread_mutex_unlock(&mmio_lock);
+static struct mmio_mapping *mmio_get(struct kvm_cpu *vcpu, uint64_t phys_addr, uint32_t len) {
+    struct mmio_mapping *mmio;
+
+    mmio_read_lock(vcpu);
+
+    mmio = mmio_table_search(__atomic_load_n(&mmio_table, __ATOMIC_SEQ_CST), phys_addr, len);
+    if (mmio == NULL)
+        mmio_put(vcpu);
+
+    return mmio;
 }
 
-int kvm__register_iotrap(struct kvm *kvm, uint64_t phys_addr, uint64_t phys_addr_len,
-             mmio_handler_fn mmio_fn, void *ptr,
+int kvm__register_iotrap_bulk(struct kvm *kvm, uint64_t phys_addr, uint64_t phys_addr_len,
+             mmio_handler_fn mmio_fn, mmio_bulk_handler_fn bulk_fn, void *ptr,
              unsigned int flags) {
     struct mmio_mapping *mmio;
+    struct mmio_table **tablep;
+    struct rb_root *tree;
     int ret;
 
+    if (flags & IOTRAP_IOEVENTFD)
+        return ioeventfd__add(kvm, phys_addr, phys_addr_len, 0, flags, mmio_fn, ptr);
+
     mmio = malloc(sizeof(*mmio));
     if (mmio == NULL)
         return -ENOMEM;
@@ -339,27 +727,85 @@ int kvm__register_iotrap(struct kvm *kvm, uint64_t phys_addr, uint64_t phys_addr
     *mmio = (struct mmio_mapping) {
         .node		= RB_INT_INIT(phys_addr, phys_addr + phys_addr_len),
         .mmio_fn	= mmio_fn,
+        .bulk_fn	= bulk_fn,
         .ptr		= ptr,
-        /*
-         * Start from 0 because kvm__deregister_mmio() doesn't decrement
-         * the reference count.
-         */
-        .refcount	= 0,
-        .remove		= 0,
+        .flags		= flags,
     };
 
+    if (trap_is_mmio(flags)) {
+        tree = &mmio_tree;
+        tablep = &mmio_table;
+    } else {
+        tree = &pio_tree;
+        tablep = &pio_table;
+    }
+
     pthread_mutex_lock(&mmio_lock);
-    ret = mmio_insert(&pio_tree, mmio);
+    ret = mmio_insert(tree, mmio);
+    if (ret == 0) {
+        ret = mmio_update(kvm, tree, tablep, NULL);
+        if (ret < 0)
+            mmio_remove(tree, mmio);
+    }
     pthread_mutex_unlock(&mmio_lock);
 
+    if (ret < 0) {
+        free(mmio);
+        return ret;
+    }
+
+    /* Without kernel support the trap simply keeps exiting */
+    if ((flags & IOTRAP_COALESCE) &&
+        kvm__coalesce_iotrap(kvm, phys_addr, phys_addr_len, flags, 1) < 0)
+        mmio->flags &= ~IOTRAP_COALESCE;
+
     return ret;
 }
 
+int kvm__register_iotrap(struct kvm *kvm, uint64_t phys_addr, uint64_t phys_addr_len,
+             mmio_handler_fn mmio_fn, void *ptr,
+             unsigned int flags) {
+    return kvm__register_iotrap_bulk(kvm, phys_addr, phys_addr_len, mmio_fn, NULL, ptr, flags);
+}
+
+/*
+ * With IOTRAP_IOEVENTFD the trap is not in the dispatch trees at all, so
+ * several registrations can share an address as long as their datamatch
+ * values differ (e.g. one per virtqueue on a notify register).
+ */
+int kvm__register_iotrap_datamatch(struct kvm *kvm, uint64_t phys_addr, uint64_t phys_addr_len,
+             mmio_handler_fn mmio_fn, void *ptr,
+             unsigned int flags, uint64_t datamatch) {
+    if (!(flags & IOTRAP_IOEVENTFD))
+        return -EINVAL;
+
+    return ioeventfd__add(kvm, phys_addr, phys_addr_len, datamatch,
+                  flags | IOTRAP_DATAMATCH, mmio_fn, ptr);
+}
+
+int kvm__deregister_iotrap_datamatch(struct kvm *kvm, uint64_t phys_addr,
+             unsigned int flags, uint64_t datamatch) {
+    if (!(flags & IOTRAP_IOEVENTFD))
+        return 0;
+
+    return ioeventfd__del(kvm, phys_addr, datamatch, flags | IOTRAP_DATAMATCH);
+}
+
 int kvm__deregister_iotrap(struct kvm *kvm, uint64_t phys_addr, unsigned int flags) {
     struct mmio_mapping *mmio;
+    struct mmio_table **tablep;
     struct rb_root *tree;
 
-    tree = &pio_tree;
+    if (flags & IOTRAP_IOEVENTFD)
+        return ioeventfd__del(kvm, phys_addr, 0, flags);
+
+    if (trap_is_mmio(flags)) {
+        tree = &mmio_tree;
+        tablep = &mmio_table;
+    } else {
+        tree = &pio_tree;
+        tablep = &pio_table;
+    }
 
     pthread_mutex_lock(&mmio_lock);
     mmio = mmio_search_single(tree, phys_addr);
@@ -368,10 +814,17 @@ int kvm__deregister_iotrap(struct kvm *kvm, uint64_t phys_addr, unsigned int fla
         return 0;
     }
 
-    if (mmio->refcount == 0)
-        mmio_deregister(kvm, tree, mmio);
-    else
-        mmio->remove = 1;
+    mmio_deregister(kvm, tree, mmio);
+
+    /*
+     * vCPUs may still be running the handler; the mapping is only freed
+     * once every read section that could have seen it has finished.
+     */
+    if (mmio_update(kvm, tree, tablep, mmio) < 0) {
+        mmio_insert(tree, mmio);
+        pthread_mutex_unlock(&mmio_lock);
+        return 0;
+    }
     pthread_mutex_unlock(&mmio_lock);
 
     return 1;
@@ -440,9 +893,21 @@ ssize_t read_in_full(int fd, void *buf, size_t count) {
 }
 
 ssize_t read_file(int fd, char *buf, size_t max_size) {
+    struct stat st;
     ssize_t ret;
+    off_t pos;
     char dummy;
 
+    /* A regular file knows how much is left; no need to read past the end */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        (pos = lseek(fd, 0, SEEK_CUR)) >= 0 && pos <= st.st_size) {
+        if ((uint64_t)(st.st_size - pos) > max_size) {
+            errno = ENOMEM;
+            return -1;
+        }
+        return read_in_full(fd, buf, st.st_size - pos);
+    }
+
     errno = 0;
     ret = read_in_full(fd, buf, max_size);
 
@@ -454,11 +919,127 @@ ssize_t read_file(int fd, char *buf, size_t max_size) {
     return -1;
 }
 
+/* Maps len bytes at an address aligned to align, trimming the excess */
+static void *mmap_aligned(size_t len, size_t align, int prot, int flags, int fd)
+{
+    uintptr_t addr, aligned;
+    void *p;
+
+    p = mmap(NULL, len + align, prot, flags, fd, 0);
+    if (p == MAP_FAILED)
+        return p;
+
+    addr = (uintptr_t)p;
+    aligned = (addr + align - 1) & ~(align - 1);
+    if (aligned > addr)
+        munmap(p, aligned - addr);
+    if (align > aligned - addr)
+        munmap((void *)(aligned + len), align - (aligned - addr));
+
+    return (void *)aligned;
+}
+
+/*
+ * Allocates guest RAM from the configured backend. The mapping is aligned
+ * to the backing page size: KVM can only use a huge EPT entry when the
+ * host address and the guest physical address agree modulo its size.
+ */
+static void *kvm__alloc_ram(struct kvm *kvm, uint64_t size, uint64_t *fd_offset)
+{
+    int prot = PROT_READ | PROT_WRITE;
+    char path[PATH_MAX];
+    struct statfs fs;
+    void *p;
+    int fd;
+
+    /* memfd is only backed by hugepages when a size is asked for */
+    if (kvm->mem_backend == KVM_MEM_MEMFD && !kvm->ram_pagesize)
+        kvm->ram_pagesize = PAGE_SIZE;
+    if (kvm->mem_backend != KVM_MEM_ANON && !kvm->ram_pagesize)
+        kvm->ram_pagesize = 2UL << 20;
+    if (kvm->mem_backend == KVM_MEM_ANON)
+        kvm->ram_pagesize = PAGE_SIZE;
+
+    size = (size + kvm->ram_pagesize - 1) & ~(kvm->ram_pagesize - 1);
+
+    switch (kvm->mem_backend) {
+    case KVM_MEM_ANON:
+        return mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    case KVM_MEM_THP:
+        p = mmap_aligned(size, kvm->ram_pagesize, prot,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1);
+        if (p != MAP_FAILED && madvise(p, size, MADV_HUGEPAGE) < 0)
+            perror("madvise(MADV_HUGEPAGE)");
+        return p;
+    case KVM_MEM_HUGETLB:
+        /* The kernel aligns hugetlb mappings itself */
+        return mmap(NULL, size, prot,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                (__builtin_ctzll(kvm->ram_pagesize) << MAP_HUGE_SHIFT), -1, 0);
+    case KVM_MEM_HUGETLBFS:
+        snprintf(path, sizeof(path), "%s/kvm-ram-XXXXXX", kvm->mem_path);
+        fd = mkstemp(path);
+        if (fd < 0) {
+            perror("unable to create hugetlbfs file");
+            return MAP_FAILED;
+        }
+        unlink(path);
+
+        /* The mount decides the page size */
+        if (fstatfs(fd, &fs) == 0 && (uint64_t)fs.f_bsize != kvm->ram_pagesize) {
+            kvm->ram_pagesize = fs.f_bsize;
+            size = (size + kvm->ram_pagesize - 1) & ~(kvm->ram_pagesize - 1);
+        }
+
+        if (ftruncate(fd, size) < 0) {
+            perror("unable to size hugetlbfs file");
+            close(fd);
+            return MAP_FAILED;
+        }
+
+        p = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+        close(fd);
+        return p;
+    case KVM_MEM_MEMFD:
+        if (kvm->ram_fd < 0) {
+            unsigned int flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+
+            if (kvm->ram_pagesize > PAGE_SIZE)
+                flags |= MFD_HUGETLB | (__builtin_ctzll(kvm->ram_pagesize) << MFD_HUGE_SHIFT);
+
+            kvm->ram_fd = memfd_create("kvm-ram", flags);
+            if (kvm->ram_fd < 0) {
+                perror("memfd_create");
+                return MAP_FAILED;
+            }
+
+            /* Whoever we share it with must not be able to pull RAM from under us */
+            if (fcntl(kvm->ram_fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+                perror("unable to seal guest RAM memfd");
+        }
+
+        /* Every bank is a window of the same file, one after the other */
+        *fd_offset = kvm->ram_fd_size;
+        if (ftruncate(kvm->ram_fd, kvm->ram_fd_size + size) < 0) {
+            perror("unable to size guest RAM memfd");
+            return MAP_FAILED;
+        }
+
+        p = mmap(NULL, size, prot, MAP_SHARED, kvm->ram_fd, *fd_offset);
+        if (p != MAP_FAILED)
+            kvm->ram_fd_size += size;
+        return p;
+    }
+
+    return MAP_FAILED;
+}
+
 void kvm__arch_init(struct kvm *kvm) {
 
     kvm->ram_slots = 0;
 
-    kvm->ram_size = RAM_SIZE;
+    if (!kvm->ram_size)
+        kvm->ram_size = RAM_SIZE;
 
     struct kvm_pit_config pit_config = {
         .flags = 0,
@@ -472,19 +1053,12 @@ void kvm__arch_init(struct kvm *kvm) {
     if (ret < 0)
         perror("KVM_CREATE_PIT2 ioctl");
 
-    kvm->ram_start = mmap(NULL, kvm->ram_size,
-                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
-
-    if ((unsigned)kvm->ram_size >= (unsigned)KVM_32BIT_GAP_START) {
-        kvm->ram_size = kvm->ram_size + KVM_32BIT_GAP_SIZE;
-        // if ram size is bigger than the 32bit RAM, then mprotect the gap PROT_NONE
-        // so that we will konw if the programme accidently writes to this address
-        if (kvm->ram_start != MAP_FAILED)
-            mprotect(kvm->ram_start + KVM_32BIT_GAP_START, KVM_32BIT_GAP_START, PROT_NONE);
-    }
-
-    if (kvm->ram_start == MAP_FAILED)
-        perror("out of memory");
+    /*
+     * RAM that does not fit below the 32-bit PCI hole continues at 4G;
+     * from here on ram_size is the end of guest RAM, hole included.
+     */
+    if (kvm->ram_size >= KVM_32BIT_GAP_START)
+        kvm->ram_size += KVM_32BIT_GAP_SIZE;
 
     // Create virtual interrupt chip
     ret = ioctl(kvm->vm_fd, KVM_CREATE_IRQCHIP);
@@ -492,291 +1066,1997 @@ void kvm__arch_init(struct kvm *kvm) {
         perror("KVM_CREATE_IRQCHIP ioctl");
 }
 
-void kvm_ram__init(struct kvm *kvm) {
-    struct kvm_userspace_memory_region mem;
-    struct kvm_mem_bank *bank;
-    struct list_head *prev_entry;
-    int ret = 0;
-
-    kvm__arch_init(kvm);
+static int mem_range_cmp(const void *a, const void *b)
+{
+    const struct kvm_mem_range *x = a, *y = b;
 
-    INIT_LIST_HEAD(&kvm->mem_banks);
+    return x->guest_phys_addr < y->guest_phys_addr ? -1 :
+           x->guest_phys_addr > y->guest_phys_addr;
+}
 
-    if (pthread_mutex_lock(&kvm->mutex) != 0)
-        perror("pthread_mtex_lock");
+/* Called with kvm->mutex held, after mem_banks changed */
+static void kvm__publish_mem_table(struct kvm *kvm)
+{
+    struct kvm_mem_table *table;
+    struct kvm_mem_bank *bank;
+    unsigned int nr = 0;
 
-    prev_entry = &kvm->mem_banks;
+    list_for_each_entry(bank, &kvm->mem_banks, list)
+        nr++;
 
-    bank = malloc(sizeof(struct kvm_mem_bank));
-    if (!bank) {
+    table = malloc(sizeof(*table) + nr * sizeof(table->ranges[0]));
+    if (!table) {
         perror("malloc");
         exit(1);
     }
 
-    INIT_LIST_HEAD(&bank->list);
-    bank->guest_phys_addr = 0;
-    bank->host_addr = kvm->ram_start;
-    bank->size = kvm->ram_size;
-    bank->slot = 0;
-
-    if (kvm->ram_size < KVM_32BIT_GAP_START) {
-        mem = (struct kvm_userspace_memory_region) {
-            .slot = 0,
-            .flags = 0,
-            .guest_phys_addr = 0,
-            .memory_size = kvm->ram_size,
-            .userspace_addr = (unsigned long)kvm->ram_start,
+    table->nr = 0;
+    list_for_each_entry(bank, &kvm->mem_banks, list) {
+        table->ranges[table->nr++] = (struct kvm_mem_range) {
+            .guest_phys_addr	= bank->guest_phys_addr,
+            .size		= bank->size,
+            .host_addr		= bank->host_addr,
+            .bank		= bank,
         };
+    }
+    qsort(table->ranges, table->nr, sizeof(table->ranges[0]), mem_range_cmp);
 
-        ret = ioctl(kvm->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem);
-        if (ret < 0) {
-            perror("KVM_SET_USER_MEMORY_REGION ioctl");
-            exit(1);
+    /* The old table is leaked on purpose, see struct kvm_mem_table */
+    __atomic_store_n(&kvm->mem_table, table, __ATOMIC_RELEASE);
+}
+
+#define MPOL_BIND	2
+
+#define BITS_PER_LONG	(8 * sizeof(long))
+
+#define KVM_MAX_HOST_NODES	1024	/* The kernel's MAX_NUMNODES limit */
+
+static long mbind_host_node(void *addr, uint64_t len, int host_node)
+{
+    unsigned long nodemask[KVM_MAX_HOST_NODES / BITS_PER_LONG];
+
+    if (host_node < 0 || host_node >= KVM_MAX_HOST_NODES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(nodemask, 0, sizeof(nodemask));
+    nodemask[host_node / BITS_PER_LONG] = 1UL << (host_node % BITS_PER_LONG);
+
+    /* The kernel ignores the last bit of maxnode */
+    return syscall(SYS_mbind, addr, len, MPOL_BIND, nodemask,
+               sizeof(nodemask) * 8 + 1, 0);
+}
+
+/* Backs [guest_phys_addr, +size) with fresh RAM in its own memory slot */
+static struct kvm_mem_bank *kvm__add_ram_bank(struct kvm *kvm, uint64_t guest_phys_addr,
+                          uint64_t size, int node)
+{
+    struct kvm_userspace_memory_region mem;
+    struct kvm_mem_bank *bank;
+
+    bank = malloc(sizeof(struct kvm_mem_bank));
+    if (!bank) {
+        perror("malloc");
+        exit(1);
+    }
+
+    INIT_LIST_HEAD(&bank->list);
+    bank->guest_phys_addr = guest_phys_addr;
+    bank->size = size;
+    bank->slot = kvm->mem_slots++;
+    bank->node = node;
+    bank->fd_offset = 0;
+    bank->flags = 0;
+    bank->dirty_bitmap = NULL;
+    bank->host_addr = kvm__alloc_ram(kvm, size, &bank->fd_offset);
+    if (bank->host_addr == MAP_FAILED) {
+        perror("out of memory");
+        exit(1);
+    }
+
+    /* Nothing is touched yet, so the policy decides where every page goes */
+    if (kvm->nr_numa_nodes && kvm->numa_nodes[node].host_node >= 0 &&
+        mbind_host_node(bank->host_addr, size, kvm->numa_nodes[node].host_node) < 0) {
+        fprintf(stderr, "unable to bind guest node %d to host node %d: %s\n",
+            node, kvm->numa_nodes[node].host_node, strerror(errno));
+        exit(1);
+    }
+
+    /* KSM only scans ranges that opted in; merged pages are COW on write */
+    if (kvm->mem_merge && !(kvm->nr_numa_nodes && kvm->numa_nodes[node].no_merge) &&
+        madvise(bank->host_addr, size, MADV_MERGEABLE) < 0)
+        perror("madvise(MADV_MERGEABLE)");
+
+    mem = (struct kvm_userspace_memory_region) {
+        .slot = bank->slot,
+        .flags = bank->flags,
+        .guest_phys_addr = bank->guest_phys_addr,
+        .memory_size = bank->size,
+        .userspace_addr = (unsigned long)bank->host_addr,
+    };
+
+    if (ioctl(kvm->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem) < 0) {
+        perror("KVM_SET_USER_MEMORY_REGION ioctl");
+        exit(1);
+    }
+
+    list_add_tail(&bank->list, &kvm->mem_banks);
+    kvm__publish_mem_table(kvm);
+
+    return bank;
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* Preallocation hands out RAM in chunks of this many bytes */
+#define PREALLOC_CHUNK		(64UL << 20)
+
+struct prealloc_work {
+    struct kvm_mem_table	*table;
+    uint64_t			chunk;		/* Multiple of the page size */
+    uint64_t			pagesize;
+    uint64_t			next;		/* Next chunk, counted over all banks */
+    int				failed;
+};
+
+static int prealloc_populate(void *addr, uint64_t len, uint64_t pagesize)
+{
+    volatile char *p;
+
+    if (madvise(addr, len, MADV_POPULATE_WRITE) == 0)
+        return 0;
+    if (errno != EINVAL)
+        return -1;
+
+    /* Kernels before 5.14: write to one byte of every page */
+    for (p = addr; p < (char *)addr + len; p += pagesize)
+        *p = *p;
+
+    return 0;
+}
+
+static void *prealloc_worker(void *param)
+{
+    struct prealloc_work *work = param;
+    struct kvm_mem_table *table = work->table;
+
+    for (;;) {
+        uint64_t n = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+        uint64_t off, len;
+        unsigned int i;
+
+        /* Find the bank holding the n-th chunk */
+        for (i = 0; i < table->nr; i++) {
+            uint64_t chunks = (table->ranges[i].size + work->chunk - 1) / work->chunk;
+
+            if (n < chunks)
+                break;
+            n -= chunks;
+        }
+        if (i == table->nr)
+            break;
+
+        off = n * work->chunk;
+        len = table->ranges[i].size - off < work->chunk ?
+              table->ranges[i].size - off : work->chunk;
+
+        if (prealloc_populate(table->ranges[i].host_addr + off, len, work->pagesize) < 0) {
+            perror("unable to preallocate guest RAM");
+            __atomic_store_n(&work->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Faults in all guest RAM up front, one thread per host CPU, so the guest
+ * never takes a host page fault on first touch. Returns -1 if the host
+ * could not back it all, e.g. the hugepage pool ran dry.
+ */
+static int kvm__prealloc_ram(struct kvm *kvm)
+{
+    struct prealloc_work work = {
+        .table = kvm->mem_table,
+        .chunk = PREALLOC_CHUNK > kvm->ram_pagesize ? PREALLOC_CHUNK : kvm->ram_pagesize,
+        .pagesize = kvm->ram_pagesize,
+    };
+    uint64_t start = stats__now(), total = 0;
+    long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *threads;
+    long i, started;
+
+    if (nr_threads < 1)
+        nr_threads = 1;
+
+    for (i = 0; i < work.table->nr; i++)
+        total += work.table->ranges[i].size;
+
+    threads = calloc(nr_threads, sizeof(*threads));
+    if (!threads)
+        return -1;
+
+    for (started = 0; started < nr_threads; started++) {
+        if (pthread_create(&threads[started], NULL, prealloc_worker, &work) != 0)
+            break;
+    }
+
+    /* If no thread could be created, do it all here */
+    if (!started)
+        prealloc_worker(&work);
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    if (work.failed)
+        return -1;
+
+    fprintf(stderr, "Preallocated %llu MiB of guest RAM in %llu ms with %ld threads\n",
+        (unsigned long long)(total >> 20),
+        (unsigned long long)(stats__now() - start) / 1000000,
+        started ? started : 1);
+
+    return 0;
+}
+
+void kvm_ram__init(struct kvm *kvm) {
+    struct kvm_mem_bank *bank;
+    uint64_t ram, ram_left;
+    unsigned int node;
+
+    kvm__arch_init(kvm);
+
+    INIT_LIST_HEAD(&kvm->mem_banks);
+
+    if (pthread_mutex_lock(&kvm->mutex) != 0)
+        perror("pthread_mtex_lock");
+
+    /*
+     * The same layout as e820_setup(): RAM runs from 0 up to the PCI hole
+     * and continues at 4G. Each NUMA node takes the next stretch of it,
+     * split into one bank either side of the hole if it straddles it.
+     * Each bank has its own mapping, so the hole costs no host memory
+     * and no hugepage reservation.
+     */
+    ram = 0;
+    for (node = 0; node < (kvm->nr_numa_nodes ? kvm->nr_numa_nodes : 1); node++) {
+        if (kvm->nr_numa_nodes)
+            ram_left = kvm->numa_nodes[node].mem_size;
+        else if (kvm->ram_size < KVM_32BIT_GAP_START)
+            ram_left = kvm->ram_size;
+        else
+            ram_left = kvm->ram_size - KVM_32BIT_GAP_SIZE;
+
+        while (ram_left) {
+            uint64_t gpa = ram < KVM_32BIT_GAP_START ? ram : ram + KVM_32BIT_GAP_SIZE;
+            uint64_t len = ram_left;
+
+            if (ram < KVM_32BIT_GAP_START && ram + len > KVM_32BIT_GAP_START)
+                len = KVM_32BIT_GAP_START - ram;
+
+            kvm__add_ram_bank(kvm, gpa, len, node);
+            ram += len;
+            ram_left -= len;
         }
+    }
 
-        list_add(&bank->list, prev_entry);
+    bank = list_first_entry(&kvm->mem_banks, struct kvm_mem_bank, list);
+    kvm->ram_start = bank->host_addr;
+
+    if (kvm->mem_prealloc && kvm__prealloc_ram(kvm) < 0)
+        exit(1);
+
+    if (kvm->mem_lock) {
+        list_for_each_entry(bank, &kvm->mem_banks, list) {
+            /* Half locked RAM would still claim to be locked */
+            if (mlock(bank->host_addr, bank->size) < 0) {
+                perror("unable to mlock guest RAM");
+                exit(1);
+            }
+        }
     }
+
+    /* The layout is final, so the memfd can never change size again */
+    if (kvm->ram_fd >= 0 &&
+        fcntl(kvm->ram_fd, F_ADD_SEALS, F_SEAL_GROW | F_SEAL_SEAL) < 0)
+        perror("unable to seal guest RAM memfd");
+
     if (pthread_mutex_unlock(&kvm->mutex) != 0)
         perror("pthread_mutex_unlock");
 }
 
+/*
+ * Most threads translate runs of addresses in the same bank (a device
+ * walking its ring, the loader filling a region), so remember the last
+ * hit. The cache is only trusted for the table it was filled from.
+ */
+static __thread struct {
+    const struct kvm_mem_table	*table;
+    const struct kvm_mem_range	*range;
+} mem_range_cache;
+
+static const struct kvm_mem_range *kvm__find_range(struct kvm *kvm, uint64_t addr)
+{
+    const struct kvm_mem_table *table = __atomic_load_n(&kvm->mem_table, __ATOMIC_ACQUIRE);
+    const struct kvm_mem_range *range = mem_range_cache.range;
+    unsigned int n;
+
+    /* Unsigned wrap makes this a single range check */
+    if (mem_range_cache.table == table && table && addr - range->guest_phys_addr < range->size)
+        return range;
+
+    if (!table || !table->nr)
+        return NULL;
+
+    /* Branch-free search for the last range starting at or below addr */
+    range = table->ranges;
+    for (n = table->nr; n > 1; n -= n / 2)
+        range = range[n / 2].guest_phys_addr <= addr ? range + n / 2 : range;
+
+    if (addr - range->guest_phys_addr >= range->size)
+        return NULL;
+
+    mem_range_cache.table = table;
+    mem_range_cache.range = range;
+    return range;
+}
+
 void *guest_flat_to_host(struct kvm *kvm, uint64_t offset) {
+    const struct kvm_mem_range *range = kvm__find_range(kvm, offset);
+
+    if (range)
+        return range->host_addr + (offset - range->guest_phys_addr);
+
+    printf("unable to translate guest address 0x%llx to host\n",
+           (unsigned long long)offset);
+    return NULL;
+}
+
+/*
+ * Like guest_flat_to_host(), but only succeeds when all of
+ * [offset, offset + len) is backed by the same bank, so the caller can
+ * access it as one host buffer. Quiet on failure, as the range usually
+ * comes from the guest.
+ */
+void *guest_flat_to_host_range(struct kvm *kvm, uint64_t offset, uint64_t len) {
+    const struct kvm_mem_range *range = kvm__find_range(kvm, offset);
+    uint64_t off;
+
+    if (!range)
+        return NULL;
+
+    off = offset - range->guest_phys_addr;
+    if (len > range->size - off)
+        return NULL;
+
+    return range->host_addr + off;
+}
+
+/*
+ * Maps [addr, addr + len) into at most max_iov host buffers, split
+ * wherever the range crosses from one bank into the next. Returns the
+ * number of buffers used, -EFAULT if part of the range is not RAM, or
+ * -E2BIG if it needs more than max_iov buffers.
+ */
+static int guest_range_map(struct kvm *kvm, uint64_t addr, uint64_t len,
+               struct iovec *iov, unsigned int max_iov)
+{
+    unsigned int nr = 0;
+
+    while (len) {
+        const struct kvm_mem_range *range = kvm__find_range(kvm, addr);
+        uint64_t off, chunk;
+
+        if (!range)
+            return -EFAULT;
+        if (nr == max_iov)
+            return -E2BIG;
+
+        off = addr - range->guest_phys_addr;
+        chunk = range->size - off < len ? range->size - off : len;
+
+        iov[nr].iov_base = range->host_addr + off;
+        iov[nr].iov_len = chunk;
+        nr++;
+
+        addr += chunk;
+        len -= chunk;
+    }
+
+    return nr;
+}
+
+int guest_iovec_map(struct kvm *kvm, const struct guest_range *ranges, unsigned int nr,
+            struct iovec *iov, unsigned int max_iov)
+{
+    unsigned int i, used = 0;
+
+    for (i = 0; i < nr; i++) {
+        int ret = guest_range_map(kvm, ranges[i].addr, ranges[i].len,
+                      iov + used, max_iov - used);
+        if (ret < 0)
+            return ret;
+
+        used += ret;
+    }
+
+    return used;
+}
+
+/*
+ * Copies to or from guest RAM across bank boundaries. On -EFAULT the part
+ * before the hole has already been copied.
+ */
+int guest_memcpy_to(struct kvm *kvm, uint64_t addr, const void *src, size_t len)
+{
+    const struct kvm_mem_range *range;
+
+    while (len) {
+        uint64_t off, chunk;
+
+        range = kvm__find_range(kvm, addr);
+        if (!range)
+            return -EFAULT;
+
+        off = addr - range->guest_phys_addr;
+        chunk = range->size - off < len ? range->size - off : len;
+        memcpy(range->host_addr + off, src, chunk);
+
+        src += chunk;
+        addr += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+int guest_memcpy_from(struct kvm *kvm, void *dst, uint64_t addr, size_t len)
+{
+    const struct kvm_mem_range *range;
+
+    while (len) {
+        uint64_t off, chunk;
+
+        range = kvm__find_range(kvm, addr);
+        if (!range)
+            return -EFAULT;
+
+        off = addr - range->guest_phys_addr;
+        chunk = range->size - off < len ? range->size - off : len;
+        memcpy(dst, range->host_addr + off, chunk);
+
+        dst += chunk;
+        addr += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+/* Bytes from addr to the end of the bank holding it */
+static uint64_t guest_bank_left(struct kvm *kvm, uint64_t addr)
+{
+    const struct kvm_mem_range *range = kvm__find_range(kvm, addr);
+
+    return range ? range->size - (addr - range->guest_phys_addr) : 0;
+}
+
+uint64_t host_to_guest_flat(struct kvm *kvm, void *ptr) {
+    const struct kvm_mem_table *table = __atomic_load_n(&kvm->mem_table, __ATOMIC_ACQUIRE);
+    unsigned int i;
+
+    for (i = 0; table && i < table->nr; i++) {
+        const struct kvm_mem_range *range = &table->ranges[i];
+
+        if ((uintptr_t)ptr - (uintptr_t)range->host_addr < range->size)
+            return range->guest_phys_addr + ((uintptr_t)ptr - (uintptr_t)range->host_addr);
+    }
+
+    printf("unable to translate host address %p to guest\n", ptr);
+    return 0;
+}
+
+/*
+ * Maps len bytes of fd at offset over guest RAM at addr, MAP_PRIVATE, so
+ * the guest reads the host page cache directly and only pages it writes
+ * get copied. Only done for private anonymous RAM, which nobody else
+ * sees; returns -1 whenever the caller has to read the file instead.
+ */
+int guest_map_file(struct kvm *kvm, uint64_t addr, int fd, off_t offset, uint64_t len)
+{
+    uint64_t map_len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    const struct kvm_mem_range *range;
     struct kvm_mem_bank *bank;
+    void *host;
+
+    if (kvm->mem_backend != KVM_MEM_ANON && kvm->mem_backend != KVM_MEM_THP)
+        return -1;
+    if (kvm->mem_lock || kvm->nr_file_maps == KVM_MAX_FILE_MAPS || !len)
+        return -1;
+    if ((addr | offset) & (PAGE_SIZE - 1))
+        return -1;
+
+    range = kvm__find_range(kvm, addr);
+    if (!range || map_len > range->size - (addr - range->guest_phys_addr))
+        return -1;
+    bank = range->bank;
+    host = range->host_addr + (addr - range->guest_phys_addr);
+
+    /* Past EOF the last page reads as zeroes, like the RAM it replaces */
+    if (mmap(host, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        /* A failed MAP_FIXED may have unmapped the range; put RAM back */
+        if (mmap(host, map_len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+            perror("unable to restore guest RAM");
+            exit(1);
+        }
+        return -1;
+    }
+
+    /* The new mapping has none of the bank's policies yet */
+    if (kvm->mem_merge)
+        madvise(host, map_len, MADV_MERGEABLE);
+    if (kvm->nr_numa_nodes && kvm->numa_nodes[bank->node].host_node >= 0)
+        mbind_host_node(host, map_len, kvm->numa_nodes[bank->node].host_node);
+
+    kvm->file_maps[kvm->nr_file_maps++] = (struct guest_range) { .addr = addr, .len = map_len };
+    return 0;
+}
+
+/*
+ * Whether any of [addr, addr + len) is a private file mapping: dropping
+ * such a page brings back the file contents rather than zeroes.
+ */
+int kvm__ram_file_backed(struct kvm *kvm, uint64_t addr, uint64_t len)
+{
+    unsigned int i;
+
+    for (i = 0; i < kvm->nr_file_maps; i++) {
+        if (addr < kvm->file_maps[i].addr + kvm->file_maps[i].len &&
+            kvm->file_maps[i].addr < addr + len)
+            return 1;
+    }
+
+    return 0;
+}
+
+static inline void *guest_real_to_host(struct kvm *kvm, uint16_t selector, uint16_t offset) {
+    unsigned long flat = ((uint32_t)selector << 4) + offset;
+
+    return guest_flat_to_host(kvm, flat);
+}
+
+static void kvm__add_boot_range(struct kvm *kvm, uint64_t addr, uint64_t len)
+{
+    if (kvm->nr_boot_ranges < KVM_MAX_BOOT_RANGES)
+        kvm->boot_ranges[kvm->nr_boot_ranges] = (struct guest_range) { .addr = addr, .len = len };
+    kvm->nr_boot_ranges++;
+}
+
+/* Real mode setup code at 0x1000:0, the protected mode kernel at 1M */
+static int kvm__load_bzimage(struct kvm *kvm, int fd_kernel, struct boot_params *boot,
+                 uint64_t lowmem_end)
+{
+    struct stat kernel_stat;
+    ssize_t file_size;
+    void *p;
+
+    if (memcmp(&boot->hdr.header, BZIMAGE_MAGIC, strlen(BZIMAGE_MAGIC)))
+        return -1;
+
+    if (lseek(fd_kernel, 0, SEEK_SET) < 0)
+        perror("lseek");
+
+    if (!boot->hdr.setup_sects)
+        boot->hdr.setup_sects = 4;
+    file_size = (boot->hdr.setup_sects + 1) << 9;
+    p = guest_real_to_host(kvm, 0x1000, 0x00);
+    if (read_in_full(fd_kernel, p, file_size) != file_size)
+        perror("kernel setup read");
+
+    if (fstat(fd_kernel, &kernel_stat) == 0 && kernel_stat.st_size > file_size &&
+        (uint64_t)(kernel_stat.st_size - file_size) <= lowmem_end - 0x100000UL &&
+        guest_map_file(kvm, 0x100000UL, fd_kernel, file_size, kernel_stat.st_size - file_size) == 0) {
+        file_size = kernel_stat.st_size - file_size;
+    } else {
+        p = guest_flat_to_host(kvm, 0x100000UL);
+        file_size = read_file(fd_kernel, p, lowmem_end - 0x100000UL);
+    }
+
+    if (file_size < 0)
+        perror("kernel read");
+    else
+        kvm__add_boot_range(kvm, 0x100000UL, file_size);
+
+    return 0;
+}
+
+ssize_t pread_in_full(int fd, void *buf, size_t count, off_t offset)
+{
+    ssize_t total = 0;
+    char *p = buf;
+
+    while (count > 0) {
+        ssize_t nr = pread(fd, p, count, offset);
+
+        if (nr < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (nr <= 0)
+            return total > 0 ? total : -1;
+
+        count -= nr;
+        total += nr;
+        p += nr;
+        offset += nr;
+    }
+
+    return total;
+}
+
+#define ELF_LOAD_CHUNK		(8UL << 20)
+#define ELF_LOAD_THREADS	8
+
+struct elf_load_chunk {
+    void		*dst;
+    off_t		offset;
+    size_t		len;
+};
+
+struct elf_load_work {
+    int			fd;
+    struct elf_load_chunk *chunks;
+    unsigned int	nr;
+    unsigned int	next;		/* Next chunk to read */
+    int			failed;
+};
+
+static void *elf_load_worker(void *param)
+{
+    struct elf_load_work *work = param;
+    unsigned int i;
+
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->nr) {
+        struct elf_load_chunk *chunk = &work->chunks[i];
+
+        if (pread_in_full(work->fd, chunk->dst, chunk->len, chunk->offset) != (ssize_t)chunk->len)
+            __atomic_store_n(&work->failed, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/*
+ * Uncompressed x86-64 vmlinux: every PT_LOAD segment goes to its
+ * physical address and the BSP enters at e_entry, which the kernel
+ * links as a physical address, through the direct 64-bit boot. No
+ * setup code comes with it, so the zero page header is made up here.
+ *
+ * Segments are mapped from the file where guest_map_file() allows it.
+ * The rest is read in 8M chunks by up to ELF_LOAD_THREADS threads; with
+ * hugetlb or memfd RAM the copy also faults in every page, which then
+ * happens on several CPUs at once.
+ */
+static int kvm__load_elf(struct kvm *kvm, int fd_kernel, struct boot_params *boot)
+{
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr *phdrs;
+    struct elf_load_work work = { .fd = fd_kernel };
+    pthread_t threads[ELF_LOAD_THREADS];
+    unsigned int nr_chunks = 0, nr_threads, i;
+    long online;
+    int ret = -1;
+
+    memcpy(&ehdr, boot, sizeof(ehdr));
+    if (ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_machine != EM_X86_64 ||
+        ehdr.e_phentsize != sizeof(Elf64_Phdr) || !ehdr.e_phnum) {
+        fprintf(stderr, "%s is not an x86-64 vmlinux\n", kvm->kernel_filename);
+        return -1;
+    }
+
+    phdrs = calloc(ehdr.e_phnum, sizeof(*phdrs));
+    if (!phdrs)
+        return -1;
+    if (pread_in_full(fd_kernel, phdrs, ehdr.e_phnum * sizeof(*phdrs), ehdr.e_phoff) !=
+        (ssize_t)(ehdr.e_phnum * sizeof(*phdrs)))
+        goto out;
+
+    for (i = 0; i < ehdr.e_phnum; i++)
+        if (phdrs[i].p_type == PT_LOAD)
+            nr_chunks += (phdrs[i].p_filesz + ELF_LOAD_CHUNK - 1) / ELF_LOAD_CHUNK;
+
+    work.chunks = calloc(nr_chunks ? nr_chunks : 1, sizeof(*work.chunks));
+    if (!work.chunks)
+        goto out;
+
+    for (i = 0; i < ehdr.e_phnum; i++) {
+        Elf64_Phdr *ph = &phdrs[i];
+        uint64_t done;
+        char *dst;
+
+        if (ph->p_type != PT_LOAD || !ph->p_memsz)
+            continue;
+        kvm__add_boot_range(kvm, ph->p_paddr, ph->p_memsz);
+
+        dst = guest_flat_to_host_range(kvm, ph->p_paddr, ph->p_memsz);
+        if (!dst || ph->p_filesz > ph->p_memsz) {
+            fprintf(stderr, "vmlinux segment at 0x%llx does not fit in guest RAM\n",
+                (unsigned long long)ph->p_paddr);
+            goto out;
+        }
+
+        if (ph->p_filesz && guest_map_file(kvm, ph->p_paddr, fd_kernel, ph->p_offset, ph->p_filesz) == 0) {
+            /* The mapping's last page carries on with the file, not with zeroes */
+            memset(dst + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+            continue;
+        }
+        memset(dst + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+
+        for (done = 0; done < ph->p_filesz; done += ELF_LOAD_CHUNK) {
+            work.chunks[work.nr++] = (struct elf_load_chunk) {
+                .dst	= dst + done,
+                .offset	= ph->p_offset + done,
+                .len	= ph->p_filesz - done < ELF_LOAD_CHUNK ? ph->p_filesz - done : ELF_LOAD_CHUNK,
+            };
+        }
+    }
+
+    /* The caller reads too */
+    online = sysconf(_SC_NPROCESSORS_ONLN);
+    nr_threads = online > 1 ? online - 1 : 0;
+    if (nr_threads > ELF_LOAD_THREADS)
+        nr_threads = ELF_LOAD_THREADS;
+    if (nr_threads > work.nr)
+        nr_threads = work.nr ? work.nr - 1 : 0;
+
+    for (i = 0; i < nr_threads; i++)
+        if (pthread_create(&threads[i], NULL, elf_load_worker, &work) != 0)
+            break;
+    nr_threads = i;
+
+    elf_load_worker(&work);
+
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    if (work.failed) {
+        perror("vmlinux read");
+        goto out;
+    }
+
+    memset(boot, 0, sizeof(*boot));
+    boot->hdr.boot_flag = 0xaa55;
+    memcpy(&boot->hdr.header, BZIMAGE_MAGIC, strlen(BZIMAGE_MAGIC));
+    boot->hdr.version = 0x020c;
+    boot->hdr.xloadflags = XLF_KERNEL_64;
+    boot->hdr.kernel_alignment = 0x1000000;
+    boot->hdr.initrd_addr_max = 0x37ffffff;
+    boot->hdr.cmdline_size = sizeof(kern_cmdline);
+    memcpy(guest_real_to_host(kvm, 0x1000, 0x00), boot, sizeof(*boot));
+
+    kvm->boot_entry = ehdr.e_entry;
+    ret = 0;
+
+out:
+    free(work.chunks);
+    free(phdrs);
+    return ret;
+}
+
+int kvm__load_kernel(struct kvm *kvm) {
+
+    int ret = 0;
+    int fd_kernel = -1, fd_initrd = -1;
+
+    struct boot_params *kern_boot;
+    struct boot_params boot;
+    size_t cmdline_size;
+    ssize_t file_size;
+    uint64_t lowmem_end;
+    void *p;
+
+    fd_kernel = open(kvm->kernel_filename, O_RDONLY);
+    if (fd_kernel < 0) {
+        printf("Unable to open kernel %s\n", kvm->kernel_filename);
+        return -1;
+    }
+
+    fd_initrd = open(kvm->initrd_filename, O_RDONLY);
+    if (fd_initrd < 0) {
+        printf("Unable to open initrd %s\n", kvm->initrd_filename);
+        return -1;
+    }
+
+    /* The kernel and initrd go straight into the bank holding 1M */
+    lowmem_end = 0x100000UL + guest_bank_left(kvm, 0x100000UL);
+
+    memset(&boot, 0, sizeof(boot));
+    file_size = read_in_full(fd_kernel, &boot, sizeof(boot));
+    if (file_size >= (ssize_t)sizeof(Elf64_Ehdr) && !memcmp(&boot, ELFMAG, SELFMAG)) {
+        if (kvm__load_elf(kvm, fd_kernel, &boot) < 0)
+            return -1;
+    } else if (file_size != sizeof(boot) ||
+           kvm__load_bzimage(kvm, fd_kernel, &boot, lowmem_end) < 0) {
+        return -1;
+    }
+
+    // copy cmdline to host
+    p = guest_flat_to_host(kvm, 0x20000);
+    cmdline_size = strlen(kern_cmdline) + 1;
+    if (cmdline_size > boot.hdr.cmdline_size)
+        cmdline_size = boot.hdr.cmdline_size;
+
+    memset(p, 0, boot.hdr.cmdline_size);
+    memcpy(p, kern_cmdline, cmdline_size - 1);
+
+    kern_boot = guest_real_to_host(kvm, 0x1000, 0x00);
+
+    kern_boot->hdr.cmd_line_ptr = 0x20000;
+    kern_boot->hdr.type_of_loader = 0xff;
+    kern_boot->hdr.heap_end_ptr = 0xfe00;
+    kern_boot->hdr.loadflags |= CAN_USE_HEAP;
+    kern_boot->hdr.vid_mode = 0;
+
+    // read initrd image into guest memory
+    struct stat initrd_stat;
+    unsigned long addr;
+
+    if (fstat(fd_initrd, &initrd_stat))
+        perror("fstat");
+
+    addr = boot.hdr.initrd_addr_max & ~0xfffff;
+    for (;;)
+    {
+        if (addr < 0x100000UL)
+        {
+            printf("Not enough memory for initrd\n");
+            return -1;
+        }
+        else if (addr < (lowmem_end - initrd_stat.st_size))
+            break;
+
+        addr -= 0x100000;
+    }
+
+    if (guest_map_file(kvm, addr, fd_initrd, 0, initrd_stat.st_size) < 0) {
+        p = guest_flat_to_host(kvm, addr);
+        if (read_in_full(fd_initrd, p, initrd_stat.st_size) < 0)
+            perror("Failed to read initrd");
+    }
+
+    kvm__add_boot_range(kvm, addr, initrd_stat.st_size);
+    kern_boot->hdr.ramdisk_image = addr;
+    kern_boot->hdr.ramdisk_size = initrd_stat.st_size;
+
+    close(fd_initrd);
+    close(fd_kernel);
+
+    return ret;
+}
+
+int kbd__init(struct kvm *kvm)
+{
+    int r;
+
+    kbd_reset();
+    state.kvm = kvm;
+    r = kvm__register_iotrap_bulk(kvm, 0x60, 2, kbd_io, kbd_io_bulk, NULL, DEVICE_BUS_IOPORT);
+    if (r < 0)
+        return r;
+    r = kvm__register_iotrap_bulk(kvm, 0x64, 2, kbd_io, kbd_io_bulk, NULL, DEVICE_BUS_IOPORT);
+    if (r < 0) {
+        kvm__deregister_iotrap(kvm, 0x60, DEVICE_BUS_IOPORT);
+        return r;
+    }
+
+    return 0;
+}
+
+static void dummy_io(struct kvm_cpu *vcpu, uint64_t addr, uint8_t *data, uint32_t len,
+             uint8_t is_write, void *ptr)
+{
+}
+
+/*
+ * Ports the guest only writes to for I/O delays, POST codes and debug
+ * output. Nobody cares about the values, so the writes are swallowed by
+ * KVM without leaving the kernel.
+ */
+static const struct {
+    uint16_t	port;
+    const char	*name;
+} sink_ports[] = {
+    { 0x0080, "io delay / POST" },
+    { 0x00e9, "debug console" },
+    { 0x00ed, "io delay" },
+    { 0x0402, "firmware debug" },
+};
+
+int ioport__setup_legacy(struct kvm *kvm)
+{
+    unsigned int i;
+    int r;
+
+    for (i = 0; i < ARRAY_SIZE(sink_ports); i++) {
+        uint16_t port = sink_ports[i].port;
+
+        r = kvm__register_iotrap(kvm, port, 1, NULL, NULL,
+                     DEVICE_BUS_IOPORT | IOTRAP_IOEVENTFD);
+        if (r == 0)
+            continue;
+
+        /* No ioeventfd support, fall back to batching the writes */
+        r = kvm__register_iotrap(kvm, port, 1, dummy_io, NULL,
+                     DEVICE_BUS_IOPORT | IOTRAP_COALESCE);
+        if (r < 0) {
+            fprintf(stderr, "unable to register %s port 0x%04x\n",
+                sink_ports[i].name, port);
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+/* Accesses that exited to userspace only to find no handler */
+static uint32_t pio_unhandled[0x10000];
+
+void kvm__dump_unhandled_ports(struct kvm *kvm)
+{
+    unsigned int top[16] = { 0 }, nr = 0, i, j;
+    uint64_t total = 0;
+
+    for (i = 0; i < ARRAY_SIZE(pio_unhandled); i++) {
+        uint32_t count = __atomic_load_n(&pio_unhandled[i], __ATOMIC_RELAXED);
+
+        if (!count)
+            continue;
+
+        total += count;
+
+        /* Keep the busiest ports, insertion sorted */
+        for (j = nr; j > 0 && pio_unhandled[top[j - 1]] < count; j--)
+            if (j < ARRAY_SIZE(top))
+                top[j] = top[j - 1];
+        if (j < ARRAY_SIZE(top)) {
+            top[j] = i;
+            if (nr < ARRAY_SIZE(top))
+                nr++;
+        }
+    }
+
+    if (!total)
+        return;
+
+    fprintf(stderr, "%llu port accesses exited with no handler, busiest ports:\n",
+        (unsigned long long)total);
+    for (i = 0; i < nr; i++)
+        fprintf(stderr, "  0x%04x: %u\n", top[i], pio_unhandled[top[i]]);
+}
+
+#define MMIO_UNHANDLED_SLOTS	64
+
+/* The same for MMIO, by address; addresses that find no free slot only count in the total */
+static struct mmio_unhandled {
+    uint64_t		key;		/* Address + 1, 0 while free */
+    uint32_t		count;
+} mmio_unhandled[MMIO_UNHANDLED_SLOTS];
+static uint64_t mmio_unhandled_total;
+
+static void mmio_account_unhandled(uint64_t addr)
+{
+    unsigned int i, hash = (addr >> 2) * 0x9e3779b97f4a7c15ULL >> 58;
+
+    __atomic_fetch_add(&mmio_unhandled_total, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < MMIO_UNHANDLED_SLOTS; i++) {
+        struct mmio_unhandled *e = &mmio_unhandled[(hash + i) % MMIO_UNHANDLED_SLOTS];
+        uint64_t cur = 0;
+
+        if (__atomic_compare_exchange_n(&e->key, &cur, addr + 1, 0,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED) || cur == addr + 1) {
+            __atomic_fetch_add(&e->count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+void kvm__dump_unhandled_mmio(struct kvm *kvm)
+{
+    unsigned int top[16] = { 0 }, nr = 0, i, j;
+    uint64_t total = __atomic_load_n(&mmio_unhandled_total, __ATOMIC_RELAXED);
+
+    if (!total)
+        return;
+
+    for (i = 0; i < MMIO_UNHANDLED_SLOTS; i++) {
+        uint32_t count = __atomic_load_n(&mmio_unhandled[i].count, __ATOMIC_RELAXED);
+
+        if (!count)
+            continue;
+
+        for (j = nr; j > 0 && mmio_unhandled[top[j - 1]].count < count; j--)
+            if (j < ARRAY_SIZE(top))
+                top[j] = top[j - 1];
+        if (j < ARRAY_SIZE(top)) {
+            top[j] = i;
+            if (nr < ARRAY_SIZE(top))
+                nr++;
+        }
+    }
+
+    fprintf(stderr, "%llu MMIO accesses exited with no handler, busiest addresses:\n",
+        (unsigned long long)total);
+    for (i = 0; i < nr; i++)
+        fprintf(stderr, "  0x%llx: %u\n", (unsigned long long)mmio_unhandled[top[i]].key - 1,
+            mmio_unhandled[top[i]].count);
+}
+
+static inline int kvm_cpu__emulate_io(struct kvm_cpu *vcpu, uint16_t port, void *data,
+                        int direction, int size, uint32_t count) {
+
+    struct mmio_mapping *mmio;
+    int is_write;
+
+    if (direction == 1)
+        is_write = 1;
+    else
+        is_write = 0;
+
+
+    mmio = pio_get(vcpu, port, size);
+    if (!mmio) {
+        __atomic_fetch_add(&pio_unhandled[port], 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    if (count > 1 && mmio->bulk_fn) {
+        mmio->bulk_fn(vcpu, port, data, size, count, is_write, mmio->ptr);
+    } else {
+        while (count--) {
+            mmio->mmio_fn(vcpu, port, data, size, is_write, mmio->ptr);
+
+            data += size;
+        }
+    }
+    mmio_put(vcpu);
+
+    return 1;
+}
+
+static inline int kvm_cpu__emulate_mmio(struct kvm_cpu *vcpu, uint64_t phys_addr, uint8_t *data,
+                        uint32_t len, uint8_t is_write) {
+    struct mmio_mapping *mmio;
+
+    mmio = mmio_get(vcpu, phys_addr, len);
+    if (!mmio) {
+        /* Nothing decodes the address: reads float high, like on a real bus */
+        if (!is_write)
+            memset(data, 0xff, len);
+        mmio_account_unhandled(phys_addr);
+        return 1;
+    }
+
+    mmio->mmio_fn(vcpu, phys_addr, data, len, is_write, mmio->ptr);
+    mmio_put(vcpu);
+
+    return 1;
+}
+
+#define COALESCED_BATCH		256
+#define COALESCED_FLUSH_MS	10
+
+static pthread_mutex_t coalesced_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int kvm__coalesced_pending(struct kvm *kvm) {
+    struct kvm_coalesced_mmio_ring *ring = kvm->coalesced_ring;
+
+    return ring && ring->first != __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Replay the coalesced ring on @vcpu. Runs of byte writes to the same
+ * port are handed to the device as one string write so that bulk
+ * handlers see them in a single call.
+ */
+static void kvm_cpu__handle_coalesced_mmio(struct kvm_cpu *vcpu) {
+    struct kvm_coalesced_mmio_ring *ring = vcpu->kvm->coalesced_ring;
+    uint8_t batch[COALESCED_BATCH];
+
+    if (!kvm__coalesced_pending(vcpu->kvm))
+        return;
+
+    pthread_mutex_lock(&coalesced_lock);
+    while (ring->first != __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE)) {
+        struct kvm_coalesced_mmio *m = &ring->coalesced_mmio[ring->first];
+        uint32_t first, n = 0;
+        uint16_t port;
+
+        if (!m->pio) {
+            kvm_cpu__emulate_mmio(vcpu, m->phys_addr, m->data, m->len, 1);
+            __atomic_store_n(&ring->first, (ring->first + 1) % KVM_COALESCED_MMIO_MAX,
+                     __ATOMIC_RELEASE);
+            continue;
+        }
+
+        if (m->len != 1) {
+            kvm_cpu__emulate_io(vcpu, m->phys_addr, m->data, KVM_EXIT_IO_OUT, m->len, 1);
+            __atomic_store_n(&ring->first, (ring->first + 1) % KVM_COALESCED_MMIO_MAX,
+                     __ATOMIC_RELEASE);
+            continue;
+        }
+
+        /*
+         * Gather consecutive single byte writes to the same port. first
+         * only moves once the device has them: KVM may reuse the slots
+         * after that, and other vCPUs must not see an empty ring before.
+         */
+        port = m->phys_addr;
+        first = ring->first;
+        do {
+            struct kvm_coalesced_mmio *next = &ring->coalesced_mmio[first];
+
+            if (!next->pio || next->len != 1 || next->phys_addr != port)
+                break;
+
+            batch[n++] = next->data[0];
+            first = (first + 1) % KVM_COALESCED_MMIO_MAX;
+        } while (n < COALESCED_BATCH && first != __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE));
+
+        kvm_cpu__emulate_io(vcpu, port, batch, KVM_EXIT_IO_OUT, 1, n);
+        __atomic_store_n(&ring->first, first, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&coalesced_lock);
+}
+
+static volatile sig_atomic_t kvm_exiting;
+
+static void kvm_cpu__kick_handler(int sig) {
+}
+
+static void kvm_cpu__exit_handler(int sig) {
+    kvm_exiting = 1;
+}
+
+/*
+ * Pausing: kvm__pause() returns once every vCPU is parked outside
+ * KVM_RUN, so nothing but the caller touches guest RAM until
+ * kvm__continue(). immediate_exit closes the window where the kick
+ * lands just before a vCPU re-enters KVM_RUN. vCPUs that left their
+ * run loop for good count as parked forever and are not kicked, main
+ * may already have joined their threads.
+ */
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+static int pause_requested;
+static int nr_parked;
+
+void kvm__pause(struct kvm *kvm)
+{
+    int i;
+
+    pthread_mutex_lock(&pause_lock);
+    __atomic_store_n(&pause_requested, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < kvm->nrcpus; i++) {
+        if (kvm->cpus[i]->parked_forever)
+            continue;
+        kvm->cpus[i]->kvm_run->immediate_exit = 1;
+        pthread_kill(kvm->cpus[i]->thread, SIGKVMKICK);
+    }
+    while (nr_parked < kvm->nrcpus)
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+void kvm__continue(struct kvm *kvm)
+{
+    pthread_mutex_lock(&pause_lock);
+    __atomic_store_n(&pause_requested, 0, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&pause_cond);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+static void kvm_cpu__park(struct kvm_cpu *vcpu)
+{
+    pthread_mutex_lock(&pause_lock);
+    nr_parked++;
+    pthread_cond_broadcast(&pause_cond);
+    while (pause_requested)
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    nr_parked--;
+    /* An exit request that came in meanwhile must still stop KVM_RUN */
+    if (!kvm_exiting)
+        vcpu->kvm_run->immediate_exit = 0;
+    pthread_mutex_unlock(&pause_lock);
+}
+
+static void kvm_cpu__park_forever(struct kvm_cpu *vcpu)
+{
+    pthread_mutex_lock(&pause_lock);
+    vcpu->parked_forever = 1;
+    nr_parked++;
+    pthread_cond_broadcast(&pause_cond);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+/*
+ * A vCPU that stays in the kernel (e.g. halted) would sit on coalesced
+ * writes forever, so make sure someone drains them every few ms.
+ */
+static void *kvm__coalesced_flush_loop(void *param) {
+    struct kvm *kvm = param;
+
+    kvm__set_thread_name("kvm-coalesced");
+
+    while (1) {
+        usleep(COALESCED_FLUSH_MS * 1000);
+
+        if (kvm__coalesced_pending(kvm))
+            pthread_kill(kvm->cpus[0]->thread, SIGKVMKICK);
+    }
+
+    return NULL;
+}
+
+void *kvm_cpu__start(void *_cpu) {
+    int err = 0;
+
+    struct kvm_cpu *cpu = _cpu;
+    struct kvm_cpu_stats *stats;
+    uint64_t t_entry, t_exit;
+
+    kvm_cpu__reset_vcpu(cpu);
+
+    /* Allocated here so the counters are local to the vcpu thread */
+    stats = kvm_cpu__stats_alloc();
+    if (stats == NULL)
+        goto panic_kvm;
+    __atomic_store_n(&cpu->stats, stats, __ATOMIC_RELEASE);
+
+    t_entry = stats__now();
+
+    // run the kvm until somebody asks us to stop
+    while (!kvm_exiting) {
+        if (__atomic_load_n(&pause_requested, __ATOMIC_SEQ_CST)) {
+            kvm_cpu__park(cpu);
+            t_entry = stats__now();
+        }
+
+        err = ioctl(cpu->vcpu_fd, KVM_RUN, 0);
+        if (err < 0 && (errno != EINTR && errno != EAGAIN))
+            perror("KVM_RUN ioctl");
+
+        t_exit = stats__now();
+        stats__account_run(stats, t_exit - t_entry,
+                   err < 0 ? KVM_EXIT_INTR : cpu->kvm_run->exit_reason);
+        if (cpu->cpu_id == 0 && !cpu->kvm->first_exit_ns)
+            cpu->kvm->first_exit_ns = t_exit;
+
+        /* Writes queued before this exit must be seen by devices first */
+        kvm_cpu__handle_coalesced_mmio(cpu);
+
+        // printf("switch kvm run exit reason: %d\n", cpu->kvm_run->exit_reason);
+        switch (cpu->kvm_run->exit_reason) {
+        case KVM_EXIT_UNKNOWN:
+            break;
+        case KVM_EXIT_INTR:
+            break;
+        case KVM_EXIT_IO: {
+            int ret;
+
+            stats__account_pio(stats, cpu->kvm_run->io.port);
+            ret = kvm_cpu__emulate_io(cpu,
+                          cpu->kvm_run->io.port,
+                          (uint8_t *)cpu->kvm_run +
+                          cpu->kvm_run->io.data_offset,
+                          cpu->kvm_run->io.direction,
+                          cpu->kvm_run->io.size,
+                          cpu->kvm_run->io.count);
+            if (!ret) {
+                err = 1;
+                goto panic_kvm;
+            }
+
+            break;
+        }
+        case KVM_EXIT_MMIO: {
+            int ret;
+
+            ret = kvm_cpu__emulate_mmio(cpu,
+                            cpu->kvm_run->mmio.phys_addr,
+                            cpu->kvm_run->mmio.data,
+                            cpu->kvm_run->mmio.len,
+                            cpu->kvm_run->mmio.is_write);
+            if (!ret) {
+                err = 1;
+                goto panic_kvm;
+            }
+
+            break;
+        }
+        case KVM_EXIT_DIRTY_RING_FULL:
+            if (kvm_cpu__dirty_ring_full(cpu) < 0)
+                goto panic_kvm;
+            break;
+
+        default: {
+            goto panic_kvm;
+
+            break;
+        }
+
+        }
+
+        t_entry = stats__now();
+        stats__account_handle(stats, t_entry - t_exit);
+    }
+
+panic_kvm:
+    kvm_cpu__park_forever(cpu);
+    return NULL;
+}
+
+static unsigned int order_base_2(unsigned int n)
+{
+    return n > 1 ? 32 - __builtin_clz(n - 1) : 0;
+}
+
+/*
+ * vCPU, socket, core and thread counts. None can exceed the 254 APIC
+ * IDs xAPIC has to offer, which also keeps their products from
+ * overflowing.
+ */
+#define KVM_MAX_TOPOLOGY_COUNT	254
+
+static int parse_topology_count(const char *arg, unsigned int *count)
+{
+    unsigned long val;
+    char *end;
+
+    errno = 0;
+    val = strtoul(arg, &end, 10);
+    if (end == arg || *end || errno || arg[strspn(arg, " \t")] == '-' ||
+        !val || val > KVM_MAX_TOPOLOGY_COUNT)
+        return -1;
+
+    *count = val;
+    return 0;
+}
+
+/*
+ * Fills in whatever part of sockets * cores * threads == nrcpus was not
+ * given on the command line, and derives the APIC ID layout from it.
+ */
+static int kvm__setup_topology(struct kvm *kvm)
+{
+    unsigned int nr_sockets = kvm->nr_sockets ? kvm->nr_sockets : 1;
+    unsigned int nr_threads = kvm->nr_threads ? kvm->nr_threads : 1;
+    unsigned int total;
+    uint32_t max_apic_id;
+
+    if (!kvm->nrcpus) {
+        if (kvm->nr_cores) {
+            kvm->nrcpus = nr_sockets * kvm->nr_cores * nr_threads;
+        } else if (kvm->nr_sockets || kvm->nr_threads) {
+            kvm->nrcpus = nr_sockets * nr_threads;
+        } else {
+            long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+            kvm->nrcpus = online > 0 && online < 32 ? online : 32;
+        }
+    }
+
+    if (!kvm->nr_cores)
+        kvm->nr_cores = kvm->nrcpus / (nr_sockets * nr_threads);
+    kvm->nr_sockets = nr_sockets;
+    kvm->nr_threads = nr_threads;
+
+    if (!kvm->nr_cores ||
+        __builtin_mul_overflow(kvm->nr_sockets * kvm->nr_threads, kvm->nr_cores, &total) ||
+        total != (unsigned int)kvm->nrcpus) {
+        fprintf(stderr, "Topology %u sockets x %u cores x %u threads does not match %d vCPUs\n",
+            kvm->nr_sockets, kvm->nr_cores, kvm->nr_threads, kvm->nrcpus);
+        return -1;
+    }
+
+    kvm->core_shift = order_base_2(kvm->nr_threads);
+    kvm->socket_shift = kvm->core_shift + order_base_2(kvm->nr_cores);
+
+    /* xAPIC only: 0xff is broadcast and the IO-APIC takes the next ID */
+    max_apic_id = kvm__cpu_apic_id(kvm, kvm->nrcpus - 1);
+    if (max_apic_id >= 0xfe) {
+        fprintf(stderr, "Topology needs APIC ID %u, at most 253 is supported\n",
+            max_apic_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Parses a list like "0-3,8,10-11" into cpus[], in order, stopping at
+ * max entries. Returns the number of entries, or -1 if it is malformed.
+ */
+static int parse_cpu_list(const char *list, int *cpus, int max)
+{
+    const char *p = list;
+    int nr = 0;
+
+    while (*p && nr < max) {
+        char *end;
+        long first, last;
+
+        first = last = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+
+        for (; first <= last && nr < max; first++)
+            cpus[nr++] = first;
+
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return -1;
+    }
+
+    return nr;
+}
+
+/* The host CPUs of a host NUMA node, from sysfs */
+static int host_node_cpus(int node, cpu_set_t *set)
+{
+    char path[64], list[4096];
+    int cpus[CPU_SETSIZE];
+    int fd, nr, i;
+    ssize_t len;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    len = read_in_full(fd, list, sizeof(list) - 1);
+    close(fd);
+    if (len <= 0)
+        return -1;
+
+    list[len] = '\0';
+    list[strcspn(list, "\n")] = '\0';
+
+    nr = parse_cpu_list(list, cpus, CPU_SETSIZE);
+    if (nr <= 0)
+        return -1;
+
+    CPU_ZERO(set);
+    for (i = 0; i < nr; i++)
+        if (cpus[i] < CPU_SETSIZE)
+            CPU_SET(cpus[i], set);
+
+    return 0;
+}
+
+/* Whether @node is one of the host's possible NUMA nodes */
+static int host_node_exists(long node)
+{
+    static int nodes[KVM_MAX_HOST_NODES];
+    char list[4096];
+    int fd, nr, i;
+    ssize_t len;
 
-    list_for_each_entry(bank, &kvm->mem_banks, list)
-    {
-        uint64_t bank_start = bank->guest_phys_addr;
-        uint64_t bank_end = bank_start + bank->size;
+    fd = open("/sys/devices/system/node/possible", O_RDONLY);
+    if (fd < 0)
+        return node == 0;
 
-        if (offset >= bank_start && offset < bank_end)
-            return bank->host_addr + (offset - bank_start);
-    }
+    len = read_in_full(fd, list, sizeof(list) - 1);
+    close(fd);
+    if (len <= 0)
+        return node == 0;
 
-    printf("unable to translate guest address 0x%llx to host\n",
-           (unsigned long long)offset);
-    return NULL;
-}
+    list[len] = '\0';
+    list[strcspn(list, "\n")] = '\0';
 
-static inline void *guest_real_to_host(struct kvm *kvm, uint16_t selector, uint16_t offset) {
-    unsigned long flat = ((uint32_t)selector << 4) + offset;
+    nr = parse_cpu_list(list, nodes, KVM_MAX_HOST_NODES);
+    for (i = 0; i < nr; i++)
+        if (nodes[i] == node)
+            return 1;
 
-    return guest_flat_to_host(kvm, flat);
+    return 0;
 }
 
-int kvm__load_kernel(struct kvm *kvm) {
-
-    int ret = 0;
-    int fd_kernel = -1, fd_initrd = -1;
+/* Parses "0-3,8,10-11" into one host CPU per vCPU, in order */
+static int kvm__parse_cpu_pin(struct kvm *kvm, const char *list)
+{
+    cpu_set_t allowed;
+    int nr;
 
-    struct boot_params *kern_boot;
-    struct boot_params boot;
-    size_t cmdline_size;
-    ssize_t file_size;
-    void *p;
+    kvm->cpu_pin = malloc(kvm->nrcpus * sizeof(*kvm->cpu_pin));
+    if (!kvm->cpu_pin)
+        return -1;
 
-    fd_kernel = open(kvm->kernel_filename, O_RDONLY);
-    if (fd_kernel < 0) {
-        printf("Unable to open kernel %s\n", kvm->kernel_filename);
+    nr = parse_cpu_list(list, kvm->cpu_pin, kvm->nrcpus);
+    if (nr < 0) {
+        fprintf(stderr, "Invalid pin list '%s'\n", list);
         return -1;
     }
 
-    fd_initrd = open(kvm->initrd_filename, O_RDONLY);
-    if (fd_initrd < 0) {
-        printf("Unable to open initrd %s\n", kvm->initrd_filename);
+    if (nr < kvm->nrcpus) {
+        fprintf(stderr, "Pin list '%s' covers %d of %d vCPUs\n", list, nr, kvm->nrcpus);
         return -1;
     }
 
-    if (read_in_full(fd_kernel, &boot, sizeof(boot)) != sizeof(boot))
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
         return -1;
 
-    if (memcmp(&boot.hdr.header, BZIMAGE_MAGIC, strlen(BZIMAGE_MAGIC)))
+    for (nr = 0; nr < kvm->nrcpus; nr++) {
+        if (kvm->cpu_pin[nr] >= CPU_SETSIZE || !CPU_ISSET(kvm->cpu_pin[nr], &allowed)) {
+            fprintf(stderr, "Host CPU %d is not available\n", kvm->cpu_pin[nr]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Parses a byte count with an optional K/M/G/T suffix */
+static int parse_size(const char *str, uint64_t *size)
+{
+    char *end;
+    unsigned long long val = strtoull(str, &end, 0);
+
+    switch (*end) {
+    case 'T': case 't': val <<= 10; /* fall through */
+    case 'G': case 'g': val <<= 10; /* fall through */
+    case 'M': case 'm': val <<= 10; /* fall through */
+    case 'K': case 'k': val <<= 10; end++; break;
+    case '\0': break;
+    default: return -1;
+    }
+
+    if (*end || end == str || !val)
         return -1;
 
-    if (lseek(fd_kernel, 0, SEEK_SET) < 0)
-        perror("lseek");
+    *size = val;
+    return 0;
+}
 
-    if (!boot.hdr.setup_sects)
-        boot.hdr.setup_sects = 4;
-    file_size = (boot.hdr.setup_sects + 1) << 9;
-    p = guest_real_to_host(kvm, 0x1000, 0x00);
-    if (read_in_full(fd_kernel, p, file_size) != file_size)
-        perror("kernel setup read");
+/*
+ * Splits "key=value,key=value" in place. Values may contain ',' (CPU
+ * lists), so only a ',' followed by a "word=" starts the next option.
+ */
+static char *next_option(char **str)
+{
+    char *opt = *str, *p;
 
-    p = guest_flat_to_host(kvm, 0x100000UL);
-    file_size = read_file(fd_kernel, p, kvm->ram_size - 0x100000UL);
+    if (!opt || !*opt)
+        return NULL;
 
-    if (file_size < 0)
-        perror("kernel read");
+    for (p = strchr(opt, ','); p; p = strchr(p + 1, ',')) {
+        size_t key = strspn(p + 1, "abcdefghijklmnopqrstuvwxyz");
 
-    // copy cmdline to host
-    p = guest_flat_to_host(kvm, 0x20000);
-    cmdline_size = strlen(kern_cmdline) + 1;
-    if (cmdline_size > boot.hdr.cmdline_size)
-        cmdline_size = boot.hdr.cmdline_size;
+        if (key && p[1 + key] == '=') {
+            *p = '\0';
+            *str = p + 1;
+            return opt;
+        }
+    }
 
-    memset(p, 0, boot.hdr.cmdline_size);
-    memcpy(p, kern_cmdline, cmdline_size - 1);
+    *str = NULL;
+    return opt;
+}
 
-    kern_boot = guest_real_to_host(kvm, 0x1000, 0x00);
+/*
+ * Parses one "mem=SIZE,cpus=LIST[,host=NODE]" --numa argument into the
+ * next guest node. Runs once the vCPU count is known.
+ */
+static int kvm__parse_numa_node(struct kvm *kvm, char *arg)
+{
+    unsigned int node = kvm->nr_numa_nodes;
+    struct kvm_numa_node *numa = &kvm->numa_nodes[node];
+    int *cpus = NULL, nr_cpus = 0, i;
+    char *opt;
 
-    kern_boot->hdr.cmd_line_ptr = 0x20000;
-    kern_boot->hdr.type_of_loader = 0xff;
-    kern_boot->hdr.heap_end_ptr = 0xfe00;
-    kern_boot->hdr.loadflags |= CAN_USE_HEAP;
-    kern_boot->hdr.vid_mode = 0;
+    if (node == KVM_MAX_NUMA_NODES) {
+        fprintf(stderr, "At most %d NUMA nodes are supported\n", KVM_MAX_NUMA_NODES);
+        return -1;
+    }
 
-    // read initrd image into guest memory
-    struct stat initrd_stat;
-    unsigned long addr;
+    numa->host_node = -1;
+
+    while ((opt = next_option(&arg))) {
+        if (!strncmp(opt, "mem=", 4)) {
+            if (parse_size(opt + 4, &numa->mem_size) < 0)
+                goto fail;
+        } else if (!strncmp(opt, "host=", 5)) {
+            char *end;
+            long host = strtol(opt + 5, &end, 10);
+
+            if (end == opt + 5 || *end || host < 0 || host >= KVM_MAX_HOST_NODES ||
+                !host_node_exists(host)) {
+                fprintf(stderr, "Host NUMA node '%s' does not exist\n", opt + 5);
+                free(cpus);
+                return -1;
+            }
+            numa->host_node = host;
+        } else if (!strcmp(opt, "merge=off")) {
+            numa->no_merge = 1;
+        } else if (!strcmp(opt, "merge=on")) {
+            numa->no_merge = 0;
+        } else if (!strncmp(opt, "cpus=", 5)) {
+            free(cpus);
+            cpus = malloc(kvm->nrcpus * sizeof(*cpus));
+            if (!cpus)
+                return -1;
+            nr_cpus = parse_cpu_list(opt + 5, cpus, kvm->nrcpus);
+            if (nr_cpus < 0)
+                goto fail;
+        } else {
+            goto fail;
+        }
+    }
 
-    if (fstat(fd_initrd, &initrd_stat))
-        perror("fstat");
+    if (!numa->mem_size)
+        goto fail;
 
-    addr = boot.hdr.initrd_addr_max & ~0xfffff;
-    for (;;)
-    {
-        if (addr < 0x100000UL)
-        {
-            printf("Not enough memory for initrd\n");
+    for (i = 0; i < nr_cpus; i++) {
+        if (cpus[i] >= kvm->nrcpus || kvm->cpu_node[cpus[i]] >= 0) {
+            fprintf(stderr, "vCPU %d is out of range or in two NUMA nodes\n", cpus[i]);
+            free(cpus);
             return -1;
         }
-        else if (addr < (kvm->ram_size - initrd_stat.st_size))
-            break;
+        kvm->cpu_node[cpus[i]] = node;
+    }
 
-        addr -= 0x100000;
+    free(cpus);
+    kvm->nr_numa_nodes++;
+    return 0;
+
+fail:
+    free(cpus);
+    fprintf(stderr, "Invalid NUMA node, expected mem=SIZE,cpus=LIST[,host=NODE][,merge=on|off]\n");
+    return -1;
+}
+
+static int kvm__setup_numa(struct kvm *kvm, char **args, unsigned int nr_args)
+{
+    uint64_t total = 0;
+    unsigned int i;
+
+    kvm->cpu_node = malloc(kvm->nrcpus * sizeof(*kvm->cpu_node));
+    if (!kvm->cpu_node)
+        return -1;
+
+    for (i = 0; i < (unsigned int)kvm->nrcpus; i++)
+        kvm->cpu_node[i] = nr_args ? -1 : 0;
+
+    for (i = 0; i < nr_args; i++) {
+        if (kvm__parse_numa_node(kvm, args[i]) < 0)
+            return -1;
+        total += kvm->numa_nodes[i].mem_size;
     }
 
-    p = guest_flat_to_host(kvm, addr);
-    if (read_in_full(fd_initrd, p, initrd_stat.st_size) < 0)
-        perror("Failed to read initrd");
+    if (!nr_args)
+        return 0;
 
-    kern_boot->hdr.ramdisk_image = addr;
-    kern_boot->hdr.ramdisk_size = initrd_stat.st_size;
+    for (i = 0; i < (unsigned int)kvm->nrcpus; i++) {
+        if (kvm->cpu_node[i] < 0) {
+            fprintf(stderr, "vCPU %u is in no NUMA node\n", i);
+            return -1;
+        }
+    }
 
-    close(fd_initrd);
-    close(fd_kernel);
+    if (kvm->ram_size && kvm->ram_size != total) {
+        fprintf(stderr, "NUMA nodes add up to %llu MiB, not the %llu MiB given with -m\n",
+            (unsigned long long)(total >> 20), (unsigned long long)(kvm->ram_size >> 20));
+        return -1;
+    }
+    kvm->ram_size = total;
 
-    return ret;
+    return 0;
 }
 
-int kbd__init(struct kvm *kvm)
+static int parse_mem_backend(struct kvm *kvm, const char *str)
 {
-    int r;
+    static const char *names[] = {
+        [KVM_MEM_ANON]		= "anon",
+        [KVM_MEM_THP]		= "thp",
+        [KVM_MEM_HUGETLB]	= "hugetlb",
+        [KVM_MEM_HUGETLBFS]	= "hugetlbfs",
+        [KVM_MEM_MEMFD]		= "memfd",
+    };
+    unsigned int i;
 
-    kbd_reset();
-    state.kvm = kvm;
-    r = kvm__register_iotrap(kvm, 0x60, 2, kbd_io, NULL, DEVICE_BUS_IOPORT);
-    if (r < 0)
-        return r;
-    r = kvm__register_iotrap(kvm, 0x64, 2, kbd_io, NULL, DEVICE_BUS_IOPORT);
-    if (r < 0) {
-        kvm__deregister_iotrap(kvm, 0x60, DEVICE_BUS_IOPORT);
-        return r;
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        if (!strcmp(str, names[i])) {
+            kvm->mem_backend = i;
+            return 0;
+        }
     }
 
-    return 0;
+    fprintf(stderr, "Unknown memory backend '%s'\n", str);
+    return -1;
 }
 
-static inline int kvm_cpu__emulate_io(struct kvm_cpu *vcpu, uint16_t port, void *data,
-                        int direction, int size, uint32_t count) {
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options] bzImage initrd\n"
+        "  -c, --cpus N          number of vCPUs (default: host CPUs, at most 32)\n"
+        "      --sockets N       sockets\n"
+        "      --cores N         cores per socket\n"
+        "      --threads N       threads per core\n"
+        "  -m, --mem SIZE        guest RAM, e.g. 512M or 64G (default 2G)\n"
+        "  -p, --pin LIST        host CPU for each vCPU, e.g. 0-3,8-11\n"
+        "      --mem-backend B   anon (default), thp, hugetlb, hugetlbfs or memfd\n"
+        "      --hugepage-size S 2M (default) or 1G, for thp and hugetlb;\n"
+        "                        makes a memfd hugetlb backed\n"
+        "      --mem-path DIR    hugetlbfs mount, implies --mem-backend hugetlbfs\n"
+        "      --mem-prealloc    fault in all guest RAM before booting\n"
+        "      --mem-lock        mlock guest RAM\n"
+        "      --mem-merge       let KSM merge identical guest pages (anon, thp)\n"
+        "      --numa mem=SIZE,cpus=LIST[,host=NODE][,merge=on|off]\n"
+        "                        add a guest NUMA node, optionally bound to a\n"
+        "                        host node and kept out of KSM; repeat for\n"
+        "                        each node\n"
+        "      --dirty-ring N    track dirty pages in N-entry per-vCPU rings\n"
+        "                        instead of KVM_GET_DIRTY_LOG bitmaps\n"
+        "      --direct-boot     start the kernel at its 64-bit entry point,\n"
+        "                        skipping the real mode setup code and BIOS\n"
+        "      --image-cache DIR keep the laid out boot RAM in DIR and map it\n"
+        "                        in on the next boot with the same files\n"
+        "      --wss MS          sample the guest working set every MS ms\n"
+        "      --zero-scan RATE  give zero guest pages back to the host, reading\n"
+        "                        at most RATE bytes per second, e.g. 64M\n"
+        "      --control PATH    UNIX socket for control commands, see control.h\n",
+        prog);
+}
 
-    struct mmio_mapping *mmio;
-    int is_write;
+enum {
+    OPT_SOCKETS = 256,
+    OPT_CORES,
+    OPT_THREADS,
+    OPT_MEM_BACKEND,
+    OPT_HUGEPAGE_SIZE,
+    OPT_MEM_PATH,
+    OPT_CONTROL,
+    OPT_MEM_PREALLOC,
+    OPT_MEM_LOCK,
+    OPT_NUMA,
+    OPT_DIRTY_RING,
+    OPT_MEM_MERGE,
+    OPT_WSS,
+    OPT_ZERO_SCAN,
+    OPT_DIRECT_BOOT,
+    OPT_IMAGE_CACHE,
+};
+
+static const struct option kvm_options[] = {
+    { "cpus",		required_argument,	NULL, 'c' },
+    { "sockets",	required_argument,	NULL, OPT_SOCKETS },
+    { "cores",		required_argument,	NULL, OPT_CORES },
+    { "threads",	required_argument,	NULL, OPT_THREADS },
+    { "mem",		required_argument,	NULL, 'm' },
+    { "pin",		required_argument,	NULL, 'p' },
+    { "mem-backend",	required_argument,	NULL, OPT_MEM_BACKEND },
+    { "hugepage-size",	required_argument,	NULL, OPT_HUGEPAGE_SIZE },
+    { "mem-path",	required_argument,	NULL, OPT_MEM_PATH },
+    { "control",	required_argument,	NULL, OPT_CONTROL },
+    { "mem-prealloc",	no_argument,		NULL, OPT_MEM_PREALLOC },
+    { "mem-lock",	no_argument,		NULL, OPT_MEM_LOCK },
+    { "mem-merge",	no_argument,		NULL, OPT_MEM_MERGE },
+    { "numa",		required_argument,	NULL, OPT_NUMA },
+    { "dirty-ring",	required_argument,	NULL, OPT_DIRTY_RING },
+    { "wss",		required_argument,	NULL, OPT_WSS },
+    { "zero-scan",	required_argument,	NULL, OPT_ZERO_SCAN },
+    { "direct-boot",	no_argument,		NULL, OPT_DIRECT_BOOT },
+    { "image-cache",	required_argument,	NULL, OPT_IMAGE_CACHE },
+    { "help",		no_argument,		NULL, 'h' },
+    { NULL, 0, NULL, 0 },
+};
+
+/* Everything the guest finds in RAM at power on */
+static int kvm__setup_boot(struct kvm *kvm, int direct_boot)
+{
+    if (kvm__load_kernel(kvm) < 0) {
+        fprintf(stderr, "Failed to load kernel\n");
+        return -1;
+    }
 
-    if (direction == 1)
-        is_write = 1;
-    else
-        is_write = 0;
+    kvm__setup_bios(kvm);
 
+    /* Falls back to the real mode entry for kernels that cannot do it */
+    if ((direct_boot || kvm->boot_entry) && kvm__setup_direct_boot(kvm) < 0 &&
+        kvm->boot_entry)
+        return -1;
 
-    mmio = mmio_get(&pio_tree, port, size);
-    if (!mmio) {
-        return 1;
+    if (mptable__init(kvm) < 0) {
+        fprintf(stderr, "Failed to initialize MP table\n");
+        return -1;
     }
 
-    while (count--) {
-        mmio->mmio_fn(vcpu, port, data, size, is_write, mmio->ptr);
-
-        data += size;
+    if (acpi__init(kvm) < 0) {
+        fprintf(stderr, "Failed to initialize ACPI tables\n");
+        return -1;
     }
-    mmio_put(vcpu->kvm, &pio_tree, mmio);
 
-    return 1;
+    return 0;
 }
 
-void *kvm_cpu__start(void *_cpu) {
-    int err = 0;
+int main(int argc, char **argv) {
+    const char *pin_list = NULL;
+    const char *control_path = NULL;
+    const char *image_cache = NULL;
+    char *numa_args[KVM_MAX_NUMA_NODES];
+    unsigned int nr_numa_args = 0;
+    unsigned int dirty_ring = 0;
+    unsigned int wss_interval = 0;
+    uint64_t zero_rate = 0;
+    int direct_boot = 0;
+    int opt;
 
-    struct kvm_cpu *cpu = _cpu;
-    kvm_cpu__reset_vcpu(cpu);
+    struct kvm *kvm = calloc(sizeof(struct kvm), 1);
 
-    // always run the kvm
-    while (1) {
-        err = ioctl(cpu->vcpu_fd, KVM_RUN, 0);
-        if (err < 0 && (errno != EINTR && errno != EAGAIN))
-            perror("KVM_RUN ioctl");
+    kvm->start_ns = stats__now();
+    kvm->ram_fd = -1;
 
-        // printf("switch kvm run exit reason: %d\n", cpu->kvm_run->exit_reason);
-        switch (cpu->kvm_run->exit_reason) {
-        case KVM_EXIT_UNKNOWN:
-            break;
-        case KVM_EXIT_IO: {
-            int ret;
+    while ((opt = getopt_long(argc, argv, "c:m:p:h", kvm_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c': {
+            unsigned int nr;
 
-            ret = kvm_cpu__emulate_io(cpu,
-                          cpu->kvm_run->io.port,
-                          (uint8_t *)cpu->kvm_run +
-                          cpu->kvm_run->io.data_offset,
-                          cpu->kvm_run->io.direction,
-                          cpu->kvm_run->io.size,
-                          cpu->kvm_run->io.count);
-            if (!ret) {
-                err = 1;
-                goto panic_kvm;
+            if (parse_topology_count(optarg, &nr) < 0) {
+                fprintf(stderr, "Invalid vCPU count '%s'\n", optarg);
+                return 1;
             }
-
+            kvm->nrcpus = nr;
             break;
         }
-
-        default: {
-            goto panic_kvm;
-
+        case OPT_SOCKETS:
+        case OPT_CORES:
+        case OPT_THREADS: {
+            unsigned int *count = opt == OPT_SOCKETS ? &kvm->nr_sockets :
+                          opt == OPT_CORES ? &kvm->nr_cores : &kvm->nr_threads;
+
+            if (parse_topology_count(optarg, count) < 0) {
+                fprintf(stderr, "Invalid --%s '%s'\n", opt == OPT_SOCKETS ? "sockets" :
+                    opt == OPT_CORES ? "cores" : "threads", optarg);
+                return 1;
+            }
             break;
         }
-
+        case 'm':
+            if (parse_size(optarg, &kvm->ram_size) < 0 || kvm->ram_size < (64UL << 20)) {
+                fprintf(stderr, "Invalid RAM size '%s', at least 64M is needed\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            pin_list = optarg;
+            break;
+        case OPT_MEM_BACKEND:
+            if (parse_mem_backend(kvm, optarg) < 0)
+                return 1;
+            break;
+        case OPT_HUGEPAGE_SIZE:
+            if (parse_size(optarg, &kvm->ram_pagesize) < 0 ||
+                (kvm->ram_pagesize != (2UL << 20) && kvm->ram_pagesize != (1UL << 30))) {
+                fprintf(stderr, "Hugepage size must be 2M or 1G\n");
+                return 1;
+            }
+            break;
+        case OPT_MEM_PATH:
+            kvm->mem_path = optarg;
+            kvm->mem_backend = KVM_MEM_HUGETLBFS;
+            break;
+        case OPT_CONTROL:
+            control_path = optarg;
+            break;
+        case OPT_MEM_PREALLOC:
+            kvm->mem_prealloc = 1;
+            break;
+        case OPT_MEM_LOCK:
+            kvm->mem_lock = 1;
+            break;
+        case OPT_MEM_MERGE:
+            kvm->mem_merge = 1;
+            break;
+        case OPT_NUMA:
+            if (nr_numa_args == KVM_MAX_NUMA_NODES) {
+                fprintf(stderr, "At most %d NUMA nodes are supported\n", KVM_MAX_NUMA_NODES);
+                return 1;
+            }
+            numa_args[nr_numa_args++] = optarg;
+            break;
+        case OPT_DIRTY_RING:
+            dirty_ring = atoi(optarg);
+            break;
+        case OPT_DIRECT_BOOT:
+            direct_boot = 1;
+            break;
+        case OPT_IMAGE_CACHE:
+            image_cache = optarg;
+            break;
+        case OPT_ZERO_SCAN:
+            if (parse_size(optarg, &zero_rate) < 0 || !zero_rate) {
+                fprintf(stderr, "Invalid zero page scan rate '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_WSS:
+            wss_interval = atoi(optarg);
+            if (!wss_interval) {
+                fprintf(stderr, "Invalid working set interval '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
         }
     }
 
-panic_kvm:
-    return NULL;
-}
-
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s bzImage initrd\n", argv[0]);
+    if (argc - optind != 2) {
+        usage(argv[0]);
         return 1;
     }
 
-    struct kvm *kvm = calloc(sizeof(struct kvm), 1);
-    kvm->kernel_filename = argv[1];
-    kvm->initrd_filename = argv[2];
-    kvm->nrcpus = 32;
+    kvm->kernel_filename = argv[optind];
+    kvm->initrd_filename = argv[optind + 1];
 
-    setup_kvm(kvm);
-    kvm_ram__init(kvm);
+    if (kvm__setup_topology(kvm) < 0)
+        return 1;
 
-    if (kvm__load_kernel(kvm) < 0) {
-        fprintf(stderr, "Failed to load kernel\n");
+    if (kvm->mem_backend == KVM_MEM_HUGETLBFS && !kvm->mem_path) {
+        fprintf(stderr, "--mem-backend hugetlbfs needs --mem-path\n");
         return 1;
     }
 
-    kvm__setup_bios(kvm);
+    /* KSM never looks at shared or hugetlb mappings */
+    if (kvm->mem_merge && kvm->mem_backend != KVM_MEM_ANON && kvm->mem_backend != KVM_MEM_THP) {
+        fprintf(stderr, "--mem-merge needs the anon or thp memory backend\n");
+        return 1;
+    }
 
-    if (mptable__init(kvm) < 0) {
-        fprintf(stderr, "Failed to initialize MP table\n");
+    /* MADV_DONTNEED refuses locked memory */
+    if (zero_rate && kvm->mem_lock) {
+        fprintf(stderr, "The zero page scanner cannot reclaim locked RAM\n");
+        return 1;
+    }
+
+    if (pin_list && kvm__parse_cpu_pin(kvm, pin_list) < 0)
+        return 1;
+
+    if (kvm__setup_numa(kvm, numa_args, nr_numa_args) < 0)
         return 1;
+
+    /* Before any other thread exists, so they all inherit SIGUSR1 blocked */
+    if (kvm__stats_init(kvm) < 0)
+        perror("unable to start stats thread");
+
+    setup_kvm(kvm);
+    kvm_ram__init(kvm);
+
+    if (!image_cache || kvm__image_cache_load(kvm, image_cache, kern_cmdline, direct_boot) < 0) {
+        if (kvm__setup_boot(kvm, direct_boot) < 0)
+            return 1;
+        if (image_cache && kvm__image_cache_save(kvm, image_cache, kern_cmdline, direct_boot) < 0)
+            fprintf(stderr, "Unable to save the boot image in %s\n", image_cache);
     }
 
+    /* KVM refuses dirty rings once a vCPU exists */
+    if (dirty_ring && kvm__dirty_ring_init(kvm, dirty_ring) < 0)
+        return 1;
+
     if (kvm_cpu__init(kvm) < 0) {
         fprintf(stderr, "Failed to initialize CPU\n");
         return 1;
@@ -797,26 +3077,98 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    if (ioport__setup_legacy(kvm) < 0) {
+        fprintf(stderr, "Failed to initialize legacy ports\n");
+        return 1;
+    }
+
+    if (control_path && kvm__control_init(kvm, control_path) < 0) {
+        fprintf(stderr, "Failed to initialize control socket\n");
+        return 1;
+    }
+
+    if (wss_interval && kvm__wss_init(kvm, wss_interval) < 0) {
+        fprintf(stderr, "Failed to start the working set sampler\n");
+        return 1;
+    }
+
+    signal(SIGKVMKICK, kvm_cpu__kick_handler);
+    signal(SIGKVMEXIT, kvm_cpu__exit_handler);
+
     // start the kvm
     for (int i = 0; i < kvm->nrcpus; i++)
     {
-        if (pthread_create(&kvm->cpus[i]->thread, NULL, kvm_cpu__start, kvm->cpus[i]) != 0)
+        pthread_attr_t attr;
+
+        /* Pinned before it runs, so its allocations land on the right node */
+        pthread_attr_init(&attr);
+        if (kvm->cpu_pin) {
+            cpu_set_t cpuset;
+
+            CPU_ZERO(&cpuset);
+            CPU_SET(kvm->cpu_pin[i], &cpuset);
+            if (pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset) != 0)
+                fprintf(stderr, "unable to pin vcpu %d to host cpu %d\n", i, kvm->cpu_pin[i]);
+        } else if (kvm->nr_numa_nodes &&
+               kvm->numa_nodes[kvm->cpu_node[i]].host_node >= 0) {
+            cpu_set_t cpuset;
+
+            /* Unpinned vCPUs at least stay next to their node's memory */
+            if (host_node_cpus(kvm->numa_nodes[kvm->cpu_node[i]].host_node, &cpuset) == 0)
+                pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+        }
+
+        if (pthread_create(&kvm->cpus[i]->thread, &attr, kvm_cpu__start, kvm->cpus[i]) != 0)
             perror("unable to create KVM VCPU thread");
+        pthread_attr_destroy(&attr);
+    }
+
+    if (kvm->coalesced_ring) {
+        pthread_t flush_thread;
+
+        if (pthread_create(&flush_thread, NULL, kvm__coalesced_flush_loop, kvm) != 0)
+            perror("unable to create coalesced flush thread");
+    }
+
+    if (zero_rate && kvm__zero_scan_init(kvm, zero_rate) < 0) {
+        fprintf(stderr, "Failed to start the zero page scanner\n");
+        return 1;
     }
 
     if (pthread_join(kvm->cpus[0]->thread, NULL) != 0)
         perror("unable to join with vcpu 0");
 
-    // do not need to pause kvm, kill the thread directly
-    for (int i = 0; i < kvm->nrcpus; i++)
-    {
-        pthread_kill(kvm->cpus[i]->thread, SIGRTMIN);
+    /* It pauses the vCPUs, so stop it before their threads go away */
+    kvm__zero_scan_exit(kvm);
+
+    /*
+     * Kick the rest out of their run loops. immediate_exit catches a
+     * vCPU that checked kvm_exiting but has not entered KVM_RUN yet.
+     */
+    kvm_exiting = 1;
+    for (int i = 1; i < kvm->nrcpus; i++) {
+        kvm->cpus[i]->kvm_run->immediate_exit = 1;
+        pthread_kill(kvm->cpus[i]->thread, SIGKVMEXIT);
     }
 
-    free(kvm->cpus[0]);
-    kvm->cpus[0] = NULL;
+    for (int i = 1; i < kvm->nrcpus; i++)
+        pthread_join(kvm->cpus[i]->thread, NULL);
+
+    kvm__dump_unhandled_ports(kvm);
+    kvm__dump_unhandled_mmio(kvm);
+    kvm__stats_dump(kvm);
+    kvm__control_exit(kvm);
+    kvm__wss_exit(kvm);
+
+    for (int i = 0; i < kvm->nrcpus; i++) {
+        kvm_cpu__stats_free(kvm->cpus[i]->stats);
+        free(kvm->cpus[i]);
+    }
 
     free(kvm->cpus);
+    free(kvm->cpuid);
+    free(kvm->cpu_pin);
+    free(kvm->cpu_node);
     free(kvm);
 
     return 0;
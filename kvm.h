@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sys/uio.h>
 #include <sys/prctl.h>
 #include <linux/kvm.h>
 #include "list.h"
@@ -15,6 +17,17 @@
 
 #define RAM_SIZE (2ULL << 30) /* 2GB */
 
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096UL
+#endif
+
+/* Makes every vCPU leave its run loop */
+#define SIGKVMEXIT SIGRTMIN
+/* Kicks a vCPU out of KVM_RUN without otherwise disturbing it */
+#define SIGKVMKICK (SIGRTMIN + 1)
+
 #ifndef BIOS_EXPORT_H_
 #define BIOS_EXPORT_H_
 
@@ -25,6 +38,7 @@ extern char bios_rom_end[0];
 
 struct kvm;
 void kvm__setup_bios(struct kvm *kvm);
+int kvm__setup_direct_boot(struct kvm *kvm);
 
 #endif /* BIOS_EXPORT_H_ */
 
@@ -45,6 +59,53 @@ struct kvm_mem_bank {
     void			*host_addr;
     uint64_t			size;
     uint32_t			slot;
+    uint64_t			fd_offset;	/* Offset in kvm->ram_fd */
+    int				node;		/* Guest NUMA node */
+    uint32_t			flags;		/* KVM_MEM_* for the slot */
+    unsigned long		*dirty_bitmap;	/* One bit per page, see dirty.c */
+};
+
+/*
+ * Immutable snapshot of mem_banks sorted by guest physical address, for
+ * lock-free translation. A new one is published whenever a bank is added;
+ * old ones are never freed, so a reader can keep using whatever it loaded.
+ * The hot fields are copied in so a lookup never chases bank pointers.
+ */
+struct kvm_mem_range {
+    uint64_t			guest_phys_addr;
+    uint64_t			size;
+    void			*host_addr;
+    struct kvm_mem_bank		*bank;
+};
+
+struct kvm_mem_table {
+    unsigned int		nr;
+    struct kvm_mem_range	ranges[];
+};
+
+#define KVM_MAX_NUMA_NODES	16
+
+/* A guest physical buffer, e.g. one descriptor of a device ring */
+struct guest_range {
+    uint64_t		addr;
+    uint64_t		len;
+};
+
+#define KVM_MAX_FILE_MAPS	8
+#define KVM_MAX_BOOT_RANGES	16
+
+struct kvm_numa_node {
+    uint64_t			mem_size;
+    int				host_node;	/* Host node RAM is bound to, or -1 */
+    int				no_merge;	/* Keep out of KSM despite --mem-merge */
+};
+
+enum kvm_mem_backend {
+    KVM_MEM_ANON,		/* Plain anonymous memory, 4K pages */
+    KVM_MEM_THP,		/* Anonymous memory with MADV_HUGEPAGE */
+    KVM_MEM_HUGETLB,		/* MAP_HUGETLB from the default pool */
+    KVM_MEM_HUGETLBFS,		/* Unlinked file on a hugetlbfs mount */
+    KVM_MEM_MEMFD,		/* One sealed memfd for all banks, shareable */
 };
 
 struct kvm {
@@ -56,14 +117,55 @@ struct kvm {
     uint32_t ram_slots;    /* for KVM_SET_USER_MEMORY_REGION */
     uint64_t ram_size;		/* Guest memory size, in bytes */
     void *ram_start;
-    uint64_t ram_pagesize;
+    uint64_t ram_pagesize;	/* Backing page size, slots are aligned to it */
+    enum kvm_mem_backend mem_backend;
+    const char *mem_path;	/* hugetlbfs mount for KVM_MEM_HUGETLBFS */
+    int ram_fd;			/* KVM_MEM_MEMFD file backing all banks, or -1 */
+    uint64_t ram_fd_size;
+    int mem_prealloc;		/* Fault all of RAM in before booting */
+    int mem_lock;		/* mlock() guest RAM */
+    int mem_merge;		/* Offer guest RAM to KSM */
     pthread_mutex_t mutex;
 
     int nrcpus; /* Number of cpus to run */
     struct kvm_cpu **cpus;
+    int vcpu_mmap_size;		/* Same for every vCPU */
+    struct kvm_cpuid2 *cpuid;	/* Filtered once, patched per vCPU */
+    uint32_t dirty_ring_entries;	/* Per vCPU, 0 for KVM_GET_DIRTY_LOG */
+
+    /* Guest topology; APIC IDs are socket:core:thread bit fields */
+    unsigned int nr_sockets;
+    unsigned int nr_cores;	/* per socket */
+    unsigned int nr_threads;	/* per core */
+    unsigned int core_shift;	/* == bits needed for nr_threads */
+    unsigned int socket_shift;	/* == core_shift + bits for nr_cores */
+    int *cpu_pin;		/* Host CPU for each vCPU, or -1 */
+
+    /* Guest NUMA layout; without --numa all RAM and vCPUs are node 0 */
+    unsigned int nr_numa_nodes;
+    struct kvm_numa_node numa_nodes[KVM_MAX_NUMA_NODES];
+    int *cpu_node;		/* Guest node of each vCPU */
 
     uint32_t mem_slots; /* for KVM_SET_USER_MEMORY_REGION */
     struct list_head mem_banks;
+    struct kvm_mem_table *mem_table;	/* Sorted view of mem_banks */
+
+    struct kvm_coalesced_mmio_ring *coalesced_ring; /* Shared by all vCPUs */
+    struct kvm_wss *wss;	/* Working set sampler, see wss.c */
+    struct kvm_zero_scan *zero_scan;	/* See zero.c */
+    int boot_direct;		/* BSP starts in long mode, see x86/boot.c */
+    uint64_t boot_entry;	/* vmlinux e_entry, 0 for a bzImage */
+
+    /* Guest RAM mapped privately from the kernel or initrd file */
+    struct guest_range file_maps[KVM_MAX_FILE_MAPS];
+    unsigned int nr_file_maps;
+
+    /* Guest RAM above 1M that kvm__load_kernel() filled in, see image.c */
+    struct guest_range boot_ranges[KVM_MAX_BOOT_RANGES];
+    unsigned int nr_boot_ranges;	/* Past KVM_MAX_BOOT_RANGES if some were lost */
+
+    uint64_t start_ns;		/* When main() started */
+    uint64_t first_exit_ns;	/* When the BSP first came back from the guest */
 
     struct interrupt_table interrupt_table;
 };
@@ -71,16 +173,44 @@ struct kvm {
 struct kvm_cpu {
     pthread_t thread;		/* VCPU thread */
     unsigned long cpu_id;
+    uint32_t apic_id;		/* Also the KVM vcpu id */
     struct kvm *kvm;		/* parent KVM */
     int	vcpu_fd;            /* For VCPU ioctls() */
     struct kvm_run *kvm_run;
     struct kvm_regs  regs;
     struct kvm_sregs sregs;
+    uint64_t mmio_epoch;	/* Non-zero while looking up an iotrap */
+    struct kvm_cpu_stats *stats;	/* Owned by the vcpu thread */
+    struct kvm_dirty_gfn *dirty_gfns;	/* Dirty ring, if enabled */
+    uint32_t dirty_fetch;		/* Next ring entry to harvest */
+    int parked_forever;			/* Left its run loop, under pause_lock */
 };
 
+static inline uint32_t kvm__cpu_apic_id(struct kvm *kvm, unsigned int cpu)
+{
+    unsigned int per_socket = kvm->nr_cores * kvm->nr_threads;
+    unsigned int socket = cpu / per_socket;
+    unsigned int core = (cpu % per_socket) / kvm->nr_threads;
+    unsigned int thread = cpu % kvm->nr_threads;
+
+    return (socket << kvm->socket_shift) | (core << kvm->core_shift) | thread;
+}
+
 void kvm__arch_read_term(struct kvm *kvm);
 void kvm__irq_line(struct kvm *kvm, int irq, int level);
+void kvm_cpu__setup_long_mode(struct kvm_cpu *vcpu);
+void kvm__pause(struct kvm *kvm);
+void kvm__continue(struct kvm *kvm);
 void *guest_flat_to_host(struct kvm *kvm, uint64_t offset);
+void *guest_flat_to_host_range(struct kvm *kvm, uint64_t offset, uint64_t len);
+
+int guest_memcpy_to(struct kvm *kvm, uint64_t addr, const void *src, size_t len);
+int guest_memcpy_from(struct kvm *kvm, void *dst, uint64_t addr, size_t len);
+int guest_iovec_map(struct kvm *kvm, const struct guest_range *ranges, unsigned int nr,
+            struct iovec *iov, unsigned int max_iov);
 uint64_t host_to_guest_flat(struct kvm *kvm, void *ptr);
+int kvm__ram_file_backed(struct kvm *kvm, uint64_t addr, uint64_t len);
+int guest_map_file(struct kvm *kvm, uint64_t addr, int fd, off_t offset, uint64_t len);
+ssize_t pread_in_full(int fd, void *buf, size_t count, off_t offset);
 
 #endif
@@ -7,6 +7,11 @@ struct list_head {
     struct list_head *next, *prev;
 };
 
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+
+#define LIST_HEAD(name) \
+    struct list_head name = LIST_HEAD_INIT(name)
+
 static inline void INIT_LIST_HEAD(struct list_head *list) {
     list->next = list;
     list->prev = list;
@@ -52,4 +57,17 @@ static inline void list_add(struct list_head *new, struct list_head *head)
     __list_add(new, head, head->next);
 }
 
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+    __list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    entry->next = entry;
+    entry->prev = entry;
+}
+
 #endif
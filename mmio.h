@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <pthread.h>
 #include "rbtree.h"
+#include "devices.h"
 
 #define RB_ROOT	{ NULL, }
 #define RB_INT_INIT(l, h) \
@@ -13,12 +14,40 @@
 #define rb_int_end(n)	((n)->low + (n)->high - 1)
 #define mmio_node(n) rb_entry(n, struct mmio_mapping, node)
 
+/*
+ * The low bits of the iotrap flags select the bus (enum device_bus_type),
+ * everything above is reserved for per-trap options.
+ */
+#define IOTRAP_BUS_MASK		0xf
+#define IOTRAP_COALESCE		(1U << 4)	/* Batch guest writes in the coalesced ring */
+#define IOTRAP_IOEVENTFD	(1U << 5)	/* Complete writes in KVM, signal an eventfd */
+#define IOTRAP_DATAMATCH	(1U << 6)	/* Only writes of the datamatch value */
+#define trap_is_mmio(flags)	(((flags) & IOTRAP_BUS_MASK) == DEVICE_BUS_MMIO)
+
 typedef void (*mmio_handler_fn)(struct kvm_cpu *vcpu, uint64_t addr, uint8_t *data,
                 uint32_t len, uint8_t is_write, void *ptr);
 
+/*
+ * Optional handler for string I/O (REP INS/OUTS): gets all @count
+ * elements of @len bytes in one call instead of one call per element.
+ */
+typedef void (*mmio_bulk_handler_fn)(struct kvm_cpu *vcpu, uint64_t addr, uint8_t *data,
+                uint32_t len, uint32_t count, uint8_t is_write, void *ptr);
+
 int kvm__register_iotrap(struct kvm *kvm, uint64_t phys_addr, uint64_t phys_addr_len,
              mmio_handler_fn mmio_fn, void *ptr,
              unsigned int flags);
+int kvm__register_iotrap_bulk(struct kvm *kvm, uint64_t phys_addr, uint64_t phys_addr_len,
+             mmio_handler_fn mmio_fn, mmio_bulk_handler_fn bulk_fn, void *ptr,
+             unsigned int flags);
+int kvm__register_iotrap_datamatch(struct kvm *kvm, uint64_t phys_addr, uint64_t phys_addr_len,
+             mmio_handler_fn mmio_fn, void *ptr,
+             unsigned int flags, uint64_t datamatch);
+int kvm__deregister_iotrap(struct kvm *kvm, uint64_t phys_addr, unsigned int flags);
+int kvm__deregister_iotrap_datamatch(struct kvm *kvm, uint64_t phys_addr,
+             unsigned int flags, uint64_t datamatch);
+int kvm__coalesce_iotrap(struct kvm *kvm, uint64_t phys_addr, uint64_t phys_addr_len,
+             unsigned int flags, int enable);
 
 struct rb_int_node {
     struct rb_node	node;
@@ -29,9 +58,30 @@ struct rb_int_node {
 struct mmio_mapping {
     struct rb_int_node	node;
     mmio_handler_fn		mmio_fn;
+    mmio_bulk_handler_fn	bulk_fn;
     void			*ptr;
-    uint32_t			refcount;
-    int			remove;
+    unsigned int		flags;
+};
+
+/*
+ * Port space is only 64K, so port traps are also indexed directly: the
+ * port's high byte selects a page of 256 mapping pointers. Pages without
+ * any registration all point to one shared empty page.
+ */
+#define PIO_PAGE_SHIFT		8
+#define PIO_PAGE_SIZE		(1U << PIO_PAGE_SHIFT)
+#define PIO_PAGE_MASK		(PIO_PAGE_SIZE - 1)
+#define PIO_NR_PAGES		(0x10000U >> PIO_PAGE_SHIFT)
+
+/*
+ * Read-only snapshot of a trap tree, sorted by start address. The exit
+ * path only ever searches a published table; it is rebuilt on every
+ * registration change.
+ */
+struct mmio_table {
+    unsigned int		nr;
+    struct mmio_mapping	**pio[PIO_NR_PAGES];
+    struct mmio_mapping	*maps[];
 };
 
 #endif
@@ -96,7 +96,7 @@ int mptable__init(struct kvm *kvm)
 	const int isabusid = 1;
 
 	unsigned int i, nentries = 0, ncpus = kvm->nrcpus;
-	unsigned int ioapicid;
+	unsigned int ioapicid, apicid, max_apicid = 0;
 	void *last_addr;
 
 	/* That is where MP table will be in guest memory */
@@ -128,8 +128,12 @@ int mptable__init(struct kvm *kvm)
 	 */
 	mpc_cpu = (void *)&mpc_table[1];
 	for (i = 0; i < ncpus; i++) {
+		apicid = kvm__cpu_apic_id(kvm, i);
+		if (apicid > max_apicid)
+			max_apicid = apicid;
+
 		mpc_cpu->type		= MP_PROCESSOR;
-		mpc_cpu->apicid		= i;
+		mpc_cpu->apicid		= apicid;
 		mpc_cpu->apicver	= KVM_APIC_VERSION;
 		mpc_cpu->cpuflag	= gen_cpu_flag(i, ncpus);
 		mpc_cpu->cpufeature	= 0x600; /* some default value */
@@ -168,7 +172,7 @@ int mptable__init(struct kvm *kvm)
 	/*
 	 * IO-APIC chip.
 	 */
-	ioapicid		= ncpus + 1;
+	ioapicid		= max_apicid + 1;
 	mpc_ioapic		= last_addr;
 	mpc_ioapic->type	= MP_IOAPIC;
 	mpc_ioapic->apicid	= ioapicid;
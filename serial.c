@@ -96,6 +96,7 @@ struct serial8250_device {
     int			rxdone;
     char		txbuf[64];
     char		rxbuf[64];
+    int			tx_coalesced;
 
     uint8_t			dll; // Divisor Latch LOW
     uint8_t			dlm;
@@ -291,14 +292,26 @@ void serial8250__update_consoles(struct kvm *kvm)
 	}
 }
 
+/*
+ * While THR empty interrupts are masked the guest polls LSR, which always
+ * exits, so THR writes can be queued by KVM instead of exiting one by one.
+ */
+static void serial8250_update_tx_coalescing(struct kvm *kvm, struct serial8250_device *dev) {
+    int coalesce = !(dev->ier & UART_IER_THRI);
+
+    if (coalesce == dev->tx_coalesced)
+        return;
+
+    if (kvm__coalesce_iotrap(kvm, dev->iobase + UART_TX, 1, SERIAL8250_BUS_TYPE, coalesce) == 0)
+        dev->tx_coalesced = coalesce;
+}
+
 static int serial8250_out(struct serial8250_device *dev, struct kvm_cpu *vcpu,
                uint16_t offset, void *data) {
     int ret = 1;
     char *addr = data;
     // printf("data is: %p\n", data);
 
-    pthread_mutex_lock(&dev->mutex);
-
     // printf("serial8250_out offset: %d\n", offset);
     switch (offset) {
     case UART_TX:
@@ -322,9 +335,10 @@ static int serial8250_out(struct serial8250_device *dev, struct kvm_cpu *vcpu,
         } 
         break;
     case UART_IER:
-        if (!(dev->lcr & UART_LCR_DLAB))
+        if (!(dev->lcr & UART_LCR_DLAB)) {
             dev->ier = ioport__read8(data) & 0x0f;
-        else
+            serial8250_update_tx_coalescing(vcpu->kvm, dev);
+        } else
             dev->dlm = ioport__read8(data);
         break;
     case UART_FCR:
@@ -344,11 +358,6 @@ static int serial8250_out(struct serial8250_device *dev, struct kvm_cpu *vcpu,
         break;
     }
 
-    serial8250_update_irq(vcpu->kvm, dev);
-
-    pthread_mutex_unlock(&dev->mutex);
-
-
     return ret;
 }
 
@@ -356,8 +365,6 @@ static int serial8250_in(struct serial8250_device *dev, struct kvm_cpu *vcpu,
               uint16_t offset, void *data) {
     int ret = 1;
 
-    pthread_mutex_lock(&dev->mutex);
-
     switch (offset) {
     case UART_RX:
         if (dev->lcr & UART_LCR_DLAB)
@@ -394,10 +401,6 @@ static int serial8250_in(struct serial8250_device *dev, struct kvm_cpu *vcpu,
         break;
     }
 
-    serial8250_update_irq(vcpu->kvm, dev);
-
-    pthread_mutex_unlock(&dev->mutex);
-
     return ret;
 }
 
@@ -408,10 +411,44 @@ static void serial8250_mmio(struct kvm_cpu *vcpu, uint64_t addr, uint8_t *data,
     // printf("is write: %d\n", is_write);
     // printf("ptr address: %p\n", ptr);
 
+    pthread_mutex_lock(&dev->mutex);
+
     if (is_write)
         serial8250_out(dev, vcpu, addr - dev->iobase, data);
     else
         serial8250_in(dev, vcpu, addr - dev->iobase, data);
+
+    serial8250_update_irq(vcpu->kvm, dev);
+
+    pthread_mutex_unlock(&dev->mutex);
+}
+
+static void serial8250_mmio_bulk(struct kvm_cpu *vcpu, uint64_t addr, uint8_t *data, uint32_t len,
+                uint32_t count, uint8_t is_write, void *ptr) {
+    struct serial8250_device *dev = ptr;
+    uint16_t offset = addr - dev->iobase;
+
+    pthread_mutex_lock(&dev->mutex);
+
+    if (is_write && offset == UART_TX && len == 1 &&
+        !(dev->lcr & UART_LCR_DLAB) && !(dev->mcr & UART_MCR_LOOP)) {
+        /* Plain transmit: hand the whole string to the console at once */
+        serial8250_flush_tx(vcpu->kvm, dev);
+        term_putc((char *)data, count, dev->id);
+    } else {
+        while (count--) {
+            if (is_write)
+                serial8250_out(dev, vcpu, offset, data);
+            else
+                serial8250_in(dev, vcpu, offset, data);
+
+            data += len;
+        }
+    }
+
+    serial8250_update_irq(vcpu->kvm, dev);
+
+    pthread_mutex_unlock(&dev->mutex);
 }
 
 int serial8250__init(struct kvm *kvm) {
@@ -421,10 +458,12 @@ int serial8250__init(struct kvm *kvm) {
     for (i = 0; i < 4; i++) {
         struct serial8250_device *dev = &devices[i];
 
-        r = kvm__register_iotrap(kvm, dev->iobase, 8, serial8250_mmio, dev,
-                 SERIAL8250_BUS_TYPE);
+        r = kvm__register_iotrap_bulk(kvm, dev->iobase, 8, serial8250_mmio,
+                      serial8250_mmio_bulk, dev, SERIAL8250_BUS_TYPE);
         if (r < 0)
             break;
+
+        serial8250_update_tx_coalescing(kvm, dev);
     }
 
     return r;
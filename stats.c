@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <linux/kvm.h>
+#include "kvm.h"
+#include "stats.h"
+#include "wss.h"
+#include "zero.h"
+
+#define STATS_TOP_PORTS		16
+
+static const char *exit_reason_names[STATS_NR_EXIT_REASONS] = {
+    [KVM_EXIT_UNKNOWN]		= "UNKNOWN",
+    [KVM_EXIT_EXCEPTION]	= "EXCEPTION",
+    [KVM_EXIT_IO]		= "IO",
+    [KVM_EXIT_HYPERCALL]	= "HYPERCALL",
+    [KVM_EXIT_DEBUG]		= "DEBUG",
+    [KVM_EXIT_HLT]		= "HLT",
+    [KVM_EXIT_MMIO]		= "MMIO",
+    [KVM_EXIT_IRQ_WINDOW_OPEN]	= "IRQ_WINDOW_OPEN",
+    [KVM_EXIT_SHUTDOWN]		= "SHUTDOWN",
+    [KVM_EXIT_FAIL_ENTRY]	= "FAIL_ENTRY",
+    [KVM_EXIT_INTR]		= "INTR",
+    [KVM_EXIT_SET_TPR]		= "SET_TPR",
+    [KVM_EXIT_TPR_ACCESS]	= "TPR_ACCESS",
+    [KVM_EXIT_NMI]		= "NMI",
+    [KVM_EXIT_INTERNAL_ERROR]	= "INTERNAL_ERROR",
+    [KVM_EXIT_SYSTEM_EVENT]	= "SYSTEM_EVENT",
+    [KVM_EXIT_IOAPIC_EOI]	= "IOAPIC_EOI",
+    [KVM_EXIT_X86_RDMSR]	= "X86_RDMSR",
+    [KVM_EXIT_X86_WRMSR]	= "X86_WRMSR",
+    [KVM_EXIT_DIRTY_RING_FULL]	= "DIRTY_RING_FULL",
+    [KVM_EXIT_X86_BUS_LOCK]	= "X86_BUS_LOCK",
+};
+
+struct kvm_cpu_stats *kvm_cpu__stats_alloc(void)
+{
+    struct kvm_cpu_stats *stats;
+
+    if (posix_memalign((void **)&stats, 64, sizeof(*stats)))
+        return NULL;
+
+    memset(stats, 0, sizeof(*stats));
+
+    /* 256K per vCPU, but only the pages of ports actually used get touched */
+    stats->pio = calloc(0x10000, sizeof(*stats->pio));
+    if (stats->pio == NULL) {
+        free(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+void kvm_cpu__stats_free(struct kvm_cpu_stats *stats)
+{
+    if (stats == NULL)
+        return;
+
+    free(stats->pio);
+    free(stats);
+}
+
+static void stats_dump_hist(const char *name, const uint64_t *hist)
+{
+    unsigned int i;
+
+    fprintf(stderr, "  %s:\n", name);
+    for (i = 0; i < STATS_NR_BUCKETS; i++) {
+        if (!hist[i])
+            continue;
+
+        if (i == 0)
+            fprintf(stderr, "    %12s ns: %llu\n", "0", (unsigned long long)hist[i]);
+        else
+            fprintf(stderr, "    %5llu-%-6llu ns: %llu\n",
+                (unsigned long long)(1ULL << (i - 1)),
+                (unsigned long long)((1ULL << (i - 1)) * 2 - 1),
+                (unsigned long long)hist[i]);
+    }
+}
+
+void kvm__stats_dump(struct kvm *kvm)
+{
+    struct kvm_cpu_stats *total;
+    unsigned int top[STATS_TOP_PORTS], nr_top = 0, i, j;
+    uint64_t exits = 0;
+    int cpu;
+
+    if (kvm->cpus == NULL)
+        return;
+
+    total = kvm_cpu__stats_alloc();
+    if (total == NULL)
+        return;
+
+    fprintf(stderr, "\n# vCPU exit statistics\n");
+
+    for (cpu = 0; cpu < kvm->nrcpus; cpu++) {
+        struct kvm_cpu_stats *stats;
+        uint64_t cpu_exits = 0;
+
+        if (kvm->cpus[cpu] == NULL)
+            continue;
+
+        stats = __atomic_load_n(&kvm->cpus[cpu]->stats, __ATOMIC_ACQUIRE);
+        if (stats == NULL)
+            continue;
+
+        for (i = 0; i < STATS_NR_EXIT_REASONS; i++) {
+            total->exits[i] += stats->exits[i];
+            cpu_exits += stats->exits[i];
+        }
+        for (i = 0; i < STATS_NR_BUCKETS; i++) {
+            total->run_hist[i] += stats->run_hist[i];
+            total->handle_hist[i] += stats->handle_hist[i];
+        }
+        for (i = 0; i < 0x10000; i++)
+            total->pio[i] += stats->pio[i];
+        total->run_ns += stats->run_ns;
+        total->handle_ns += stats->handle_ns;
+
+        if (cpu_exits)
+            fprintf(stderr, "  vcpu%d: %llu exits, %llu ms in KVM_RUN, %llu ms handling exits\n",
+                cpu, (unsigned long long)cpu_exits,
+                (unsigned long long)(stats->run_ns / 1000000),
+                (unsigned long long)(stats->handle_ns / 1000000));
+        exits += cpu_exits;
+    }
+
+    fprintf(stderr, "  total: %llu exits\n", (unsigned long long)exits);
+    if (kvm->first_exit_ns)
+        fprintf(stderr, "  first guest exit %llu us after start\n",
+            (unsigned long long)(kvm->first_exit_ns - kvm->start_ns) / 1000);
+
+    fprintf(stderr, "  by reason:\n");
+    for (i = 0; i < STATS_NR_EXIT_REASONS; i++) {
+        if (!total->exits[i])
+            continue;
+
+        if (exit_reason_names[i])
+            fprintf(stderr, "    %-16s %llu\n", exit_reason_names[i],
+                (unsigned long long)total->exits[i]);
+        else
+            fprintf(stderr, "    %-16u %llu\n", i, (unsigned long long)total->exits[i]);
+    }
+
+    /* Busiest ports, insertion sorted */
+    for (i = 0; i < 0x10000; i++) {
+        if (!total->pio[i])
+            continue;
+
+        for (j = nr_top; j > 0 && total->pio[top[j - 1]] < total->pio[i]; j--)
+            if (j < STATS_TOP_PORTS)
+                top[j] = top[j - 1];
+        if (j < STATS_TOP_PORTS) {
+            top[j] = i;
+            if (nr_top < STATS_TOP_PORTS)
+                nr_top++;
+        }
+    }
+
+    if (nr_top) {
+        fprintf(stderr, "  by port:\n");
+        for (i = 0; i < nr_top; i++)
+            fprintf(stderr, "    0x%04x %u\n", top[i], total->pio[top[i]]);
+    }
+
+    stats_dump_hist("time in KVM_RUN", total->run_hist);
+    stats_dump_hist("time handling exits", total->handle_hist);
+
+    kvm_cpu__stats_free(total);
+
+    if (kvm->mem_merge)
+        kvm__ksm_dump(kvm, stderr);
+    kvm__wss_dump(kvm, stderr);
+    kvm__zero_scan_dump(kvm, stderr);
+}
+
+static long long read_ksm_sysfs(const char *name)
+{
+    char path[64];
+    long long val = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/kernel/mm/ksm/%s", name);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fscanf(f, "%lld", &val) != 1)
+        val = -1;
+    fclose(f);
+    return val;
+}
+
+/* ksmd's CPU time so far, in ms, or -1 if it cannot be found */
+static long long ksmd_cpu_ms(void)
+{
+    unsigned long long utime, stime;
+    long long ms = -1;
+    struct dirent *de;
+    char path[300], comm[32];
+    DIR *dir;
+    FILE *f;
+
+    dir = opendir("/proc");
+    if (!dir)
+        return -1;
+
+    while ((de = readdir(dir)) && ms < 0) {
+        if (de->d_name[0] < '1' || de->d_name[0] > '9')
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/%s/stat", de->d_name);
+        f = fopen(path, "r");
+        if (!f)
+            continue;
+        /* pid (comm) state ppid pgrp session tty tpgid flags minflt cminflt majflt cmajflt utime stime */
+        if (fscanf(f, "%*d (%31[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+               comm, &utime, &stime) == 3 && !strcmp(comm, "ksmd"))
+            ms = (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+        fclose(f);
+    }
+
+    closedir(dir);
+    return ms;
+}
+
+/*
+ * KSM report: what ksmd costs the host, what this process gained from
+ * it according to /proc/self/ksm_stat, and per bank how much of the
+ * resident guest RAM is merged according to /proc/self/smaps.
+ */
+void kvm__ksm_dump(struct kvm *kvm, FILE *out)
+{
+    const struct kvm_mem_table *table = __atomic_load_n(&kvm->mem_table, __ATOMIC_ACQUIRE);
+    unsigned long long rss[KVM_MAX_NUMA_NODES * 2] = { 0 }, ksm[KVM_MAX_NUMA_NODES * 2] = { 0 };
+    unsigned long long start, end, kb;
+    const struct kvm_mem_range *cur = NULL;
+    unsigned int i, nr;
+    char line[256];
+    FILE *f;
+
+    fprintf(out, "\n# KSM\n");
+    fprintf(out, "  ksmd: %s, %lld full scans, %lld ms CPU\n",
+        read_ksm_sysfs("run") == 1 ? "running" : "stopped",
+        read_ksm_sysfs("full_scans"), ksmd_cpu_ms());
+    fprintf(out, "  host: %lld pages shared, %lld sharing them\n",
+        read_ksm_sysfs("pages_shared"), read_ksm_sysfs("pages_sharing"));
+
+    f = fopen("/proc/self/ksm_stat", "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f))
+            fprintf(out, "  %s", line);
+        fclose(f);
+    }
+
+    if (!table)
+        return;
+    nr = table->nr < sizeof(rss) / sizeof(rss[0]) ? table->nr : sizeof(rss) / sizeof(rss[0]);
+
+    /* A bank may have been split into several VMAs, e.g. by mbind() or KSM */
+    f = fopen("/proc/self/smaps", "r");
+    if (!f)
+        return;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%llx-%llx ", &start, &end) == 2) {
+            cur = NULL;
+            for (i = 0; i < nr; i++) {
+                const struct kvm_mem_range *range = &table->ranges[i];
+
+                if (start >= (unsigned long)range->host_addr &&
+                    start < (unsigned long)range->host_addr + range->size)
+                    cur = range;
+            }
+        } else if (cur && sscanf(line, "Rss: %llu kB", &kb) == 1) {
+            rss[cur - table->ranges] += kb;
+        } else if (cur && sscanf(line, "KSM: %llu kB", &kb) == 1) {
+            ksm[cur - table->ranges] += kb;
+        }
+    }
+    fclose(f);
+
+    for (i = 0; i < nr; i++) {
+        const struct kvm_mem_range *range = &table->ranges[i];
+
+        fprintf(out, "  bank 0x%llx-0x%llx: %llu kB resident, %llu kB merged, %llu kB unshared\n",
+            (unsigned long long)range->guest_phys_addr,
+            (unsigned long long)(range->guest_phys_addr + range->size),
+            rss[i], ksm[i], rss[i] - ksm[i]);
+    }
+}
+
+static void *stats_thread(void *param)
+{
+    struct kvm *kvm = param;
+    sigset_t sigset;
+    int sig;
+
+    kvm__set_thread_name("kvm-stats");
+
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+
+    while (sigwait(&sigset, &sig) == 0)
+        kvm__stats_dump(kvm);
+
+    return NULL;
+}
+
+/*
+ * SIGUSR1 dumps the statistics. It must be called before any other
+ * thread is created, so that they all inherit the blocked SIGUSR1 and
+ * only the stats thread ever receives it.
+ */
+int kvm__stats_init(struct kvm *kvm)
+{
+    pthread_t thread;
+    sigset_t sigset;
+
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL) != 0)
+        return -1;
+
+    if (pthread_create(&thread, NULL, stats_thread, kvm) != 0)
+        return -1;
+
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef KVM__STATS_H
+#define KVM__STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "kvm.h"
+
+#define STATS_NR_EXIT_REASONS	64
+#define STATS_NR_BUCKETS	65	/* log2(ns) buckets, bucket 0 is 0ns */
+
+/*
+ * Per-vCPU exit statistics. Only the owning vCPU thread ever writes to
+ * its block, so the hot path uses plain increments; dumps read the
+ * counters racily, which is fine for 64-bit values on x86.
+ */
+struct kvm_cpu_stats {
+    uint64_t		exits[STATS_NR_EXIT_REASONS];
+    uint64_t		run_hist[STATS_NR_BUCKETS];	/* Time inside KVM_RUN */
+    uint64_t		handle_hist[STATS_NR_BUCKETS];	/* Time handling the exit */
+    uint64_t		run_ns;
+    uint64_t		handle_ns;
+    uint32_t		*pio;				/* Exits per I/O port */
+} __attribute__((aligned(64)));
+
+static inline uint64_t stats__now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned int stats__bucket(uint64_t ns)
+{
+    return ns ? 64 - __builtin_clzll(ns) : 0;
+}
+
+static inline void stats__account_run(struct kvm_cpu_stats *stats, uint64_t ns,
+                      uint32_t exit_reason)
+{
+    stats->run_ns += ns;
+    stats->run_hist[stats__bucket(ns)]++;
+    stats->exits[exit_reason < STATS_NR_EXIT_REASONS ? exit_reason : 0]++;
+}
+
+static inline void stats__account_handle(struct kvm_cpu_stats *stats, uint64_t ns)
+{
+    stats->handle_ns += ns;
+    stats->handle_hist[stats__bucket(ns)]++;
+}
+
+static inline void stats__account_pio(struct kvm_cpu_stats *stats, uint16_t port)
+{
+    stats->pio[port]++;
+}
+
+struct kvm_cpu_stats *kvm_cpu__stats_alloc(void);
+void kvm_cpu__stats_free(struct kvm_cpu_stats *stats);
+void kvm__stats_dump(struct kvm *kvm);
+void kvm__ksm_dump(struct kvm *kvm, FILE *out);
+int kvm__stats_init(struct kvm *kvm);
+
+#endif /* KVM__STATS_H */
@@ -61,7 +61,7 @@ int term_getc(struct kvm *kvm, int term) {
         term_got_escape = 0;
         if (c == 'x') {
             if (kvm->cpus[0] && kvm->cpus[0]->thread != 0)
-                pthread_kill(kvm->cpus[0]->thread, SIGRTMIN);
+                pthread_kill(kvm->cpus[0]->thread, SIGKVMEXIT);
         }
         if (c == 0x01)
             return c;
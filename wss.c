@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "kvm.h"
+#include "dirty.h"
+#include "stats.h"
+#include "wss.h"
+
+#define WSS_NR_BUCKETS		9	/* Ages 0, 1, 2-3, ..., 128-255 */
+#define WSS_AGE_MAX		255
+#define WSS_PAGEMAP_BATCH	512	/* pagemap entries per read */
+
+#define PAGEMAP_PRESENT		(1ULL << 63)
+#define PAGEMAP_PFN_MASK	((1ULL << 55) - 1)
+
+struct kvm_wss {
+    struct kvm		*kvm;
+    unsigned int	interval_ms;
+    int			pagemap_fd;	/* -1 when using the dirty log */
+    int			idle_fd;
+    unsigned int	nr_banks;
+    struct kvm_mem_bank	**banks;
+    uint8_t		**age;		/* Per bank, one byte per page */
+    int			primed;		/* Idle bits were set by a previous window */
+
+    pthread_mutex_t	lock;		/* Protects the report and stop below */
+    uint64_t		windows;
+    uint64_t		hist[WSS_NR_BUCKETS];	/* Pages per age bucket */
+    uint64_t		scan_ns;	/* Cost of the last window */
+
+    pthread_t		thread;
+    pthread_cond_t	cond;		/* Wakes the sampler up early to stop */
+    int			stop;
+};
+
+static unsigned int wss_bucket(uint8_t age)
+{
+    return age ? 32 - __builtin_clz(age) : 0;
+}
+
+static void wss_age_all(struct kvm_wss *wss)
+{
+    unsigned int i;
+    uint64_t j;
+
+    for (i = 0; i < wss->nr_banks; i++) {
+        uint8_t *age = wss->age[i];
+
+        for (j = 0; j < wss->banks[i]->size / PAGE_SIZE; j++)
+            age[j] += age[j] < WSS_AGE_MAX;
+    }
+}
+
+static int wss_dirty_range(struct kvm *kvm, uint64_t addr, uint64_t len, void *ptr)
+{
+    struct kvm_wss *wss = ptr;
+    unsigned int i;
+
+    for (i = 0; i < wss->nr_banks; i++) {
+        struct kvm_mem_bank *bank = wss->banks[i];
+
+        if (addr >= bank->guest_phys_addr && addr < bank->guest_phys_addr + bank->size) {
+            memset(wss->age[i] + (addr - bank->guest_phys_addr) / PAGE_SIZE, 0, len / PAGE_SIZE);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * One pass over a bank: a page whose idle bit was cleared since the
+ * last pass was accessed. Every resident page is marked idle again for
+ * the next window. Guest RAM is mostly physically contiguous, so the
+ * bitmap is read and written a 64-page word at a time.
+ */
+static int wss_scan_idle(struct kvm_wss *wss, unsigned int b)
+{
+    struct kvm_mem_bank *bank = wss->banks[b];
+    uint64_t entries[WSS_PAGEMAP_BATCH];
+    uint64_t npages = bank->size / PAGE_SIZE;
+    uint64_t word = 0, idle = 0, mark = 0, word_idx = -1ULL;
+    uint64_t page, i, n;
+    off_t base = (unsigned long)bank->host_addr / PAGE_SIZE * sizeof(uint64_t);
+
+    for (page = 0; page < npages; page += n) {
+        n = npages - page < WSS_PAGEMAP_BATCH ? npages - page : WSS_PAGEMAP_BATCH;
+        if (pread(wss->pagemap_fd, entries, n * sizeof(uint64_t),
+              base + page * sizeof(uint64_t)) != (ssize_t)(n * sizeof(uint64_t)))
+            return -1;
+
+        for (i = 0; i < n; i++) {
+            uint64_t pfn = entries[i] & PAGEMAP_PFN_MASK;
+
+            if (!(entries[i] & PAGEMAP_PRESENT) || !pfn)
+                continue;
+
+            if (pfn / 64 != word_idx) {
+                if (mark && pwrite(wss->idle_fd, &mark, sizeof(mark), word_idx * 8) < 0)
+                    return -1;
+                word_idx = pfn / 64;
+                mark = 0;
+                if (pread(wss->idle_fd, &word, sizeof(word), word_idx * 8) != sizeof(word))
+                    word = 0;
+                idle = word;
+            }
+
+            if (wss->primed && !(idle & (1ULL << (pfn % 64))))
+                wss->age[b][page + i] = 0;
+            mark |= 1ULL << (pfn % 64);
+        }
+    }
+
+    if (mark && pwrite(wss->idle_fd, &mark, sizeof(mark), word_idx * 8) < 0)
+        return -1;
+
+    return 0;
+}
+
+static void wss_window(struct kvm_wss *wss)
+{
+    uint64_t hist[WSS_NR_BUCKETS] = { 0 };
+    uint64_t start = stats__now();
+    unsigned int i;
+    uint64_t j;
+
+    wss_age_all(wss);
+
+    if (wss->pagemap_fd >= 0) {
+        for (i = 0; i < wss->nr_banks; i++) {
+            if (wss_scan_idle(wss, i) < 0) {
+                perror("page_idle scan");
+                break;
+            }
+        }
+        wss->primed = 1;
+    } else {
+        kvm__dirty_log_collect(wss->kvm, wss_dirty_range, wss);
+    }
+
+    for (i = 0; i < wss->nr_banks; i++)
+        for (j = 0; j < wss->banks[i]->size / PAGE_SIZE; j++)
+            hist[wss_bucket(wss->age[i][j])]++;
+
+    pthread_mutex_lock(&wss->lock);
+    memcpy(wss->hist, hist, sizeof(hist));
+    wss->windows++;
+    wss->scan_ns = stats__now() - start;
+    pthread_mutex_unlock(&wss->lock);
+}
+
+/* Sleeps for one window, or less if kvm__wss_exit() is waiting. Returns non-zero to stop. */
+static int wss_sleep(struct kvm_wss *wss)
+{
+    struct timespec until;
+    int stop;
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += wss->interval_ms / 1000;
+    until.tv_nsec += (wss->interval_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&wss->lock);
+    while (!wss->stop && pthread_cond_timedwait(&wss->cond, &wss->lock, &until) == 0)
+        ;
+    stop = wss->stop;
+    pthread_mutex_unlock(&wss->lock);
+
+    return stop;
+}
+
+static void *wss_thread(void *param)
+{
+    struct kvm_wss *wss = param;
+
+    kvm__set_thread_name("kvm-wss");
+
+    do {
+        wss_window(wss);
+    } while (!wss_sleep(wss));
+
+    return NULL;
+}
+
+int kvm__wss_init(struct kvm *kvm, unsigned int interval_ms)
+{
+    struct kvm_mem_bank *bank;
+    struct kvm_wss *wss;
+    pthread_condattr_t attr;
+    unsigned int i = 0;
+
+    wss = calloc(1, sizeof(*wss));
+    if (!wss)
+        return -1;
+
+    wss->kvm = kvm;
+    wss->interval_ms = interval_ms;
+    wss->pagemap_fd = -1;
+    wss->idle_fd = -1;
+    pthread_mutex_init(&wss->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wss->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    list_for_each_entry(bank, &kvm->mem_banks, list)
+        wss->nr_banks++;
+
+    wss->banks = calloc(wss->nr_banks, sizeof(*wss->banks));
+    wss->age = calloc(wss->nr_banks, sizeof(*wss->age));
+    if (!wss->banks || !wss->age)
+        return -1;
+
+    /* Nothing has been seen yet, so everything starts out old */
+    list_for_each_entry(bank, &kvm->mem_banks, list) {
+        wss->banks[i] = bank;
+        wss->age[i] = malloc(bank->size / PAGE_SIZE);
+        if (!wss->age[i])
+            return -1;
+        memset(wss->age[i], WSS_AGE_MAX, bank->size / PAGE_SIZE);
+        i++;
+    }
+
+    if (kvm->mem_backend != KVM_MEM_HUGETLB && kvm->mem_backend != KVM_MEM_HUGETLBFS) {
+        wss->idle_fd = open("/sys/kernel/mm/page_idle/bitmap", O_RDWR | O_CLOEXEC);
+        if (wss->idle_fd >= 0)
+            wss->pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    }
+
+    if (wss->pagemap_fd < 0) {
+        if (wss->idle_fd >= 0)
+            close(wss->idle_fd);
+        wss->idle_fd = -1;
+        if (kvm__dirty_log_start(kvm) < 0)
+            return -1;
+    }
+
+    if (pthread_create(&wss->thread, NULL, wss_thread, wss) != 0)
+        return -1;
+
+    __atomic_store_n(&kvm->wss, wss, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Stops the sampler; it walks the vCPUs' dirty rings, so before they
+ * are freed. The report stays around for the final dump, and for the
+ * stats and control threads, which can dump it until exit.
+ */
+void kvm__wss_exit(struct kvm *kvm)
+{
+    struct kvm_wss *wss = kvm->wss;
+
+    if (!wss)
+        return;
+
+    pthread_mutex_lock(&wss->lock);
+    wss->stop = 1;
+    pthread_cond_signal(&wss->cond);
+    pthread_mutex_unlock(&wss->lock);
+    pthread_join(wss->thread, NULL);
+}
+
+/* The sampler then owns the log: anyone else collecting would steal its pages */
+int kvm__wss_uses_dirty_log(struct kvm *kvm)
+{
+    struct kvm_wss *wss = __atomic_load_n(&kvm->wss, __ATOMIC_ACQUIRE);
+
+    return wss && wss->pagemap_fd < 0;
+}
+
+void kvm__wss_dump(struct kvm *kvm, FILE *out)
+{
+    struct kvm_wss *wss = kvm->wss;
+    uint64_t hist[WSS_NR_BUCKETS], windows, scan_ns, sum = 0;
+    unsigned int i;
+
+    if (!wss)
+        return;
+
+    pthread_mutex_lock(&wss->lock);
+    memcpy(hist, wss->hist, sizeof(hist));
+    windows = wss->windows;
+    scan_ns = wss->scan_ns;
+    pthread_mutex_unlock(&wss->lock);
+
+    fprintf(out, "\n# Working set (%s, %u ms windows)\n",
+        wss->pagemap_fd >= 0 ? "page_idle" : "dirty log, writes only", wss->interval_ms);
+    fprintf(out, "  %llu windows, last scan took %llu us\n",
+        (unsigned long long)windows, (unsigned long long)(scan_ns / 1000));
+
+    /* Bucket i holds ages below 2^i, so the running sum is the WSS over 2^i windows */
+    for (i = 0; i < WSS_NR_BUCKETS - 1; i++) {
+        sum += hist[i];
+        fprintf(out, "  last %3u windows: %llu MiB\n", 1U << i,
+            (unsigned long long)(sum * PAGE_SIZE >> 20));
+    }
+    fprintf(out, "  idle longer:      %llu MiB\n",
+        (unsigned long long)(hist[WSS_NR_BUCKETS - 1] * PAGE_SIZE >> 20));
+}
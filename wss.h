@@ -0,0 +1,24 @@
+#ifndef KVM__WSS_H
+#define KVM__WSS_H
+
+#include <stdio.h>
+#include "kvm.h"
+
+/*
+ * Working set sampler. Every window it finds which guest pages were
+ * accessed since the previous one and keeps a saturating per-page age
+ * (windows since last access, one byte per page). The report is a
+ * histogram of those ages, i.e. the working set size over the last
+ * 1, 2, 4, ... windows.
+ *
+ * Accesses come from /sys/kernel/mm/page_idle, which sees guest reads
+ * and writes through the MMU notifiers. Without it, or for hugetlb RAM
+ * which page_idle ignores, the KVM dirty log is used instead and only
+ * writes count.
+ */
+int kvm__wss_init(struct kvm *kvm, unsigned int interval_ms);
+void kvm__wss_exit(struct kvm *kvm);
+void kvm__wss_dump(struct kvm *kvm, FILE *out);
+int kvm__wss_uses_dirty_log(struct kvm *kvm);
+
+#endif /* KVM__WSS_H */
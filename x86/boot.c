@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/kvm.h>
+#include <asm/bootparam.h>
+#include "kvm.h"
+#include <kvm/boot-protocol.h>
+#include <kvm/e820.h>
+
+/*
+ * Direct 64-bit boot, as in the "64-bit BOOT PROTOCOL" section of the
+ * kernel's boot.rst: the zero page, page tables and GDT are built here
+ * and the BSP starts in long mode at the kernel's 64-bit entry point, so
+ * neither the real mode setup code nor the BIOS services run. The BIOS
+ * image is still installed for the e820 map and the MP/ACPI tables.
+ *
+ * Everything lives in low memory the kernel does not load over.
+ */
+#define BOOT_GDT_ADDR		0x0500
+#define BOOT_PARAMS_ADDR	0x7000
+#define BOOT_STACK_ADDR		0x8ff0
+#define BOOT_PML4_ADDR		0x9000
+#define BOOT_PDPT_ADDR		0xa000
+#define BOOT_PD_ADDR		0xb000	/* Four pages: 2M mappings of the low 4G */
+#define BOOT_SETUP_ADDR		0x10000	/* Where kvm__load_kernel() put the setup header */
+
+#define BOOT_CS			0x10	/* __BOOT_CS */
+#define BOOT_DS			0x18	/* __BOOT_DS */
+
+#define PTE_PRESENT		(1ULL << 0)
+#define PTE_RW			(1ULL << 1)
+#define PTE_PS			(1ULL << 7)
+
+#define X86_CR0_PE		(1ULL << 0)
+#define X86_CR0_PG		(1ULL << 31)
+#define X86_CR4_PAE		(1ULL << 5)
+#define EFER_LME		(1ULL << 8)
+#define EFER_LMA		(1ULL << 10)
+
+int kvm__setup_direct_boot(struct kvm *kvm)
+{
+    struct boot_params *setup = guest_flat_to_host(kvm, BOOT_SETUP_ADDR);
+    struct e820map *e820 = guest_flat_to_host(kvm, E820_MAP_START);
+    struct boot_params *zero_page;
+    uint64_t *pml4, *pdpt, *pd, *gdt;
+    unsigned int i;
+
+    if (setup->hdr.version < 0x020c || !(setup->hdr.xloadflags & XLF_KERNEL_64)) {
+        fprintf(stderr, "Kernel has no 64-bit entry point, booting through the BIOS\n");
+        return -1;
+    }
+
+    /* kvm__load_kernel() already filled in the loader fields of the header */
+    zero_page = guest_flat_to_host(kvm, BOOT_PARAMS_ADDR);
+    memset(zero_page, 0, sizeof(*zero_page));
+    zero_page->hdr = setup->hdr;
+
+    for (i = 0; i < e820->nr_map && i < E820_MAX_ENTRIES_ZEROPAGE; i++) {
+        zero_page->e820_table[i] = (struct boot_e820_entry) {
+            .addr = e820->map[i].addr,
+            .size = e820->map[i].size,
+            .type = e820->map[i].type,
+        };
+    }
+    zero_page->e820_entries = i;
+
+    /* The kernel only needs itself, the zero page and the cmdline mapped */
+    pml4 = guest_flat_to_host(kvm, BOOT_PML4_ADDR);
+    pdpt = guest_flat_to_host(kvm, BOOT_PDPT_ADDR);
+    pd = guest_flat_to_host(kvm, BOOT_PD_ADDR);
+    memset(pml4, 0, PAGE_SIZE);
+    memset(pdpt, 0, PAGE_SIZE);
+
+    pml4[0] = BOOT_PDPT_ADDR | PTE_PRESENT | PTE_RW;
+    for (i = 0; i < 4; i++)
+        pdpt[i] = (BOOT_PD_ADDR + i * PAGE_SIZE) | PTE_PRESENT | PTE_RW;
+    for (i = 0; i < 4 * 512; i++)
+        pd[i] = ((uint64_t)i << 21) | PTE_PRESENT | PTE_RW | PTE_PS;
+
+    /* Flat 4G segments: null, unused, __BOOT_CS (64-bit code), __BOOT_DS */
+    gdt = guest_flat_to_host(kvm, BOOT_GDT_ADDR);
+    gdt[0] = 0;
+    gdt[1] = 0;
+    gdt[2] = 0x00af9b000000ffffULL;
+    gdt[3] = 0x00cf93000000ffffULL;
+
+    kvm->boot_direct = 1;
+    return 0;
+}
+
+/* Long mode state for the BSP; APs still come up through INIT/SIPI */
+void kvm_cpu__setup_long_mode(struct kvm_cpu *vcpu)
+{
+    struct kvm_segment code = {
+        .base		= 0,
+        .limit		= 0xffffffff,
+        .selector	= BOOT_CS,
+        .type		= 0xb,		/* Execute/read, accessed */
+        .present	= 1,
+        .s		= 1,
+        .l		= 1,
+        .g		= 1,
+    };
+    struct kvm_segment data = {
+        .base		= 0,
+        .limit		= 0xffffffff,
+        .selector	= BOOT_DS,
+        .type		= 0x3,		/* Read/write, accessed */
+        .present	= 1,
+        .s		= 1,
+        .db		= 1,
+        .g		= 1,
+    };
+
+    if (ioctl(vcpu->vcpu_fd, KVM_GET_SREGS, &vcpu->sregs) < 0)
+        perror("KVM_GET_SREGS failed");
+
+    vcpu->sregs.cs = code;
+    vcpu->sregs.ds = data;
+    vcpu->sregs.es = data;
+    vcpu->sregs.fs = data;
+    vcpu->sregs.gs = data;
+    vcpu->sregs.ss = data;
+
+    vcpu->sregs.gdt.base = BOOT_GDT_ADDR;
+    vcpu->sregs.gdt.limit = 4 * sizeof(uint64_t) - 1;
+
+    vcpu->sregs.cr3 = BOOT_PML4_ADDR;
+    vcpu->sregs.cr4 |= X86_CR4_PAE;
+    vcpu->sregs.cr0 |= X86_CR0_PE | X86_CR0_PG;
+    vcpu->sregs.efer |= EFER_LME | EFER_LMA;
+
+    if (ioctl(vcpu->vcpu_fd, KVM_SET_SREGS, &vcpu->sregs) < 0)
+        perror("KVM_SET_SREGS failed");
+
+    /* A bzImage's 64-bit entry point is 0x200 into the protected mode kernel */
+    vcpu->regs = (struct kvm_regs) {
+        .rflags	= 0x0000000000000002ULL,
+        .rip	= vcpu->kvm->boot_entry ? vcpu->kvm->boot_entry : BZ_KERNEL_START + 0x200,
+        .rsi	= BOOT_PARAMS_ADDR,
+        .rsp	= BOOT_STACK_ADDR,
+        .rbp	= BOOT_STACK_ADDR,
+    };
+
+    if (ioctl(vcpu->vcpu_fd, KVM_SET_REGS, &vcpu->regs) < 0)
+        perror("KVM_SET_REGS failed");
+}
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <emmintrin.h>
+#include "kvm.h"
+#include "stats.h"
+#include "zero.h"
+
+#define ZERO_CHUNK		(2UL << 20)	/* mincore() and rate limiting unit */
+#define ZERO_BATCH		4096		/* Candidates dropped per pause */
+#define ZERO_PASS_DELAY_S	10		/* Between two passes over RAM */
+
+struct kvm_zero_scan {
+    struct kvm		*kvm;
+    uint64_t		rate;		/* Bytes per second */
+    uint64_t		unit;		/* Backing page size */
+    int			shared;		/* MAP_SHARED RAM, needs MADV_REMOVE */
+    int			idle;		/* Scans at SCHED_IDLE */
+
+    void		*batch[ZERO_BATCH];
+    unsigned int	nr_batch;
+
+    /* Only written by the scanner, read racily by dumps */
+    uint64_t		passes;
+    uint64_t		scanned;
+    uint64_t		reclaimed;
+    uint64_t		raced;		/* Candidates written before the pause */
+    uint64_t		dropped;	/* Batches not flushed, stuck at SCHED_IDLE */
+    uint64_t		pause_ns;
+
+    pthread_t		thread;
+    pthread_mutex_t	lock;		/* Wakes the scanner up early to stop */
+    pthread_cond_t	cond;
+    int			stop;
+};
+
+/*
+ * Non-zero pages nearly always show it in the first cache line, so
+ * that is tested on its own before the rest is ORed together 256 bytes
+ * at a time.
+ */
+static int zero_page(const void *addr, uint64_t len)
+{
+    const __m128i *p = addr, *end = (const __m128i *)((const char *)addr + len);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc;
+
+    acc = _mm_or_si128(_mm_or_si128(p[0], p[1]), _mm_or_si128(p[2], p[3]));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+        return 0;
+
+    for (p += 4; p < end; p += 16) {
+        acc = _mm_or_si128(_mm_or_si128(_mm_or_si128(p[0], p[1]), _mm_or_si128(p[2], p[3])),
+                   _mm_or_si128(_mm_or_si128(p[4], p[5]), _mm_or_si128(p[6], p[7])));
+        acc = _mm_or_si128(acc, _mm_or_si128(_mm_or_si128(p[8], p[9]), _mm_or_si128(p[10], p[11])));
+        acc = _mm_or_si128(acc, _mm_or_si128(_mm_or_si128(p[12], p[13]), _mm_or_si128(p[14], p[15])));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int zero_set_sched(int policy)
+{
+    struct sched_param sp = { .sched_priority = 0 };
+
+    return pthread_setschedparam(pthread_self(), policy, &sp) == 0 ? 0 : -1;
+}
+
+/* Sleeps for @ns, or less if kvm__zero_scan_exit() is waiting. Returns non-zero to stop. */
+static int zero_sleep(struct kvm_zero_scan *zs, uint64_t ns)
+{
+    struct timespec until;
+    int stop;
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += ns / 1000000000ULL + (until.tv_nsec + ns % 1000000000ULL) / 1000000000ULL;
+    until.tv_nsec = (until.tv_nsec + ns % 1000000000ULL) % 1000000000ULL;
+
+    pthread_mutex_lock(&zs->lock);
+    while (!zs->stop && pthread_cond_timedwait(&zs->cond, &zs->lock, &until) == 0)
+        ;
+    stop = zs->stop;
+    pthread_mutex_unlock(&zs->lock);
+
+    return stop;
+}
+
+/*
+ * A candidate may have been written since it was scanned, so each one
+ * is checked again with every vCPU parked, and dropped while they still
+ * are. Nothing else in the VMM writes guest RAM behind the vCPUs' back.
+ * The page stays zero either way, so dirty logging has nothing to see.
+ */
+static void zero_flush(struct kvm_zero_scan *zs)
+{
+    int advice = zs->shared ? MADV_REMOVE : MADV_DONTNEED;
+    char *run = NULL;
+    uint64_t start, run_len = 0;
+    unsigned int i;
+
+    if (!zs->nr_batch)
+        return;
+
+    /*
+     * Every vCPU waits on this thread until kvm__continue(), so the
+     * window must not run at SCHED_IDLE: on a busy host it might never
+     * be scheduled. If it cannot leave SCHED_IDLE, skip the batch.
+     */
+    if (zs->idle && zero_set_sched(SCHED_OTHER) < 0) {
+        zs->dropped++;
+        zs->nr_batch = 0;
+        return;
+    }
+
+    start = stats__now();
+    kvm__pause(zs->kvm);
+
+    /* Candidates are in address order; each madvise() call flushes TLBs, so merge runs */
+    for (i = 0; i <= zs->nr_batch; i++) {
+        char *addr = i < zs->nr_batch ? zs->batch[i] : NULL;
+
+        if (addr && !zero_page(addr, zs->unit)) {
+            zs->raced++;
+            continue;
+        }
+        if (addr && run && run + run_len == addr) {
+            run_len += zs->unit;
+            continue;
+        }
+        if (run && madvise(run, run_len, advice) == 0)
+            zs->reclaimed += run_len;
+        run = addr;
+        run_len = zs->unit;
+    }
+
+    zs->pause_ns += stats__now() - start;
+    kvm__continue(zs->kvm);
+    zs->nr_batch = 0;
+
+    if (zs->idle)
+        zero_set_sched(SCHED_IDLE);
+}
+
+static int zero_scan_bank(struct kvm_zero_scan *zs, struct kvm_mem_bank *bank)
+{
+    unsigned char vec[ZERO_CHUNK / PAGE_SIZE];
+    uint64_t chunk = zs->unit > ZERO_CHUNK ? zs->unit : ZERO_CHUNK;
+    uint64_t off, len, i, step = zs->unit / PAGE_SIZE;
+
+    for (off = 0; off < bank->size; off += chunk) {
+        char *addr = bank->host_addr + off;
+
+        len = bank->size - off < chunk ? bank->size - off : chunk;
+
+        /* Reading a page that is not there would fault it in */
+        if (mincore(addr, ZERO_CHUNK < len ? ZERO_CHUNK : len, vec) < 0)
+            continue;
+
+        for (i = 0; i < len / zs->unit; i++) {
+            if (!(vec[i * step] & 1))
+                continue;
+            if (kvm__ram_file_backed(zs->kvm, bank->guest_phys_addr + off + i * zs->unit, zs->unit))
+                continue;
+            if (!zero_page(addr + i * zs->unit, zs->unit))
+                continue;
+
+            zs->batch[zs->nr_batch++] = addr + i * zs->unit;
+            if (zs->nr_batch == ZERO_BATCH)
+                zero_flush(zs);
+        }
+
+        zs->scanned += len;
+
+        if (zero_sleep(zs, len * 1000000000ULL / zs->rate))
+            return -1;
+    }
+
+    zero_flush(zs);
+    return 0;
+}
+
+static void *zero_scan_thread(void *param)
+{
+    struct kvm_zero_scan *zs = param;
+    struct kvm_mem_bank *bank;
+
+    kvm__set_thread_name("kvm-zero");
+
+    /* Only ever use CPU time nobody else wants */
+    if (zs->idle && zero_set_sched(SCHED_IDLE) < 0) {
+        fprintf(stderr, "unable to make the zero page scanner SCHED_IDLE\n");
+        zs->idle = 0;
+    }
+
+    for (;;) {
+        list_for_each_entry(bank, &zs->kvm->mem_banks, list) {
+            if (zero_scan_bank(zs, bank) < 0)
+                return NULL;
+        }
+        zs->passes++;
+        if (zero_sleep(zs, ZERO_PASS_DELAY_S * 1000000000ULL))
+            return NULL;
+    }
+}
+
+/*
+ * Leaving SCHED_IDLE needs CAP_SYS_NICE or a high enough RLIMIT_NICE,
+ * so try the round trip on a throwaway thread first.
+ */
+static void *zero_probe_thread(void *param)
+{
+    int *ok = param;
+
+    *ok = zero_set_sched(SCHED_IDLE) == 0 && zero_set_sched(SCHED_OTHER) == 0;
+    return NULL;
+}
+
+/* Pauses the vCPUs from time to time, so start it once their threads exist */
+int kvm__zero_scan_init(struct kvm *kvm, uint64_t rate)
+{
+    struct kvm_zero_scan *zs;
+    pthread_condattr_t attr;
+    pthread_t probe;
+
+    zs = calloc(1, sizeof(*zs));
+    if (!zs)
+        return -1;
+
+    zs->kvm = kvm;
+    zs->rate = rate;
+    zs->unit = kvm->ram_pagesize ? kvm->ram_pagesize : PAGE_SIZE;
+    zs->shared = kvm->mem_backend == KVM_MEM_MEMFD || kvm->mem_backend == KVM_MEM_HUGETLBFS;
+
+    if (pthread_create(&probe, NULL, zero_probe_thread, &zs->idle) == 0)
+        pthread_join(probe, NULL);
+    if (!zs->idle)
+        fprintf(stderr, "zero page scanner: cannot leave SCHED_IDLE to pause the vCPUs "
+            "(needs CAP_SYS_NICE or RLIMIT_NICE), scanning at normal priority\n");
+
+    pthread_mutex_init(&zs->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&zs->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&zs->thread, NULL, zero_scan_thread, zs) != 0) {
+        free(zs);
+        return -1;
+    }
+
+    kvm->zero_scan = zs;
+    return 0;
+}
+
+/*
+ * Stops the scanner; it may be in the middle of a pause, so before the
+ * vCPUs go away. The counters stay around for the final report, and
+ * for the stats and control threads, which can dump them until exit.
+ */
+void kvm__zero_scan_exit(struct kvm *kvm)
+{
+    struct kvm_zero_scan *zs = kvm->zero_scan;
+
+    if (!zs)
+        return;
+
+    pthread_mutex_lock(&zs->lock);
+    zs->stop = 1;
+    pthread_cond_signal(&zs->cond);
+    pthread_mutex_unlock(&zs->lock);
+    pthread_join(zs->thread, NULL);
+}
+
+void kvm__zero_scan_dump(struct kvm *kvm, FILE *out)
+{
+    struct kvm_zero_scan *zs = kvm->zero_scan;
+
+    if (!zs)
+        return;
+
+    fprintf(out, "\n# Zero page scanner (%llu MiB/s, %llu K pages)\n",
+        (unsigned long long)(zs->rate >> 20), (unsigned long long)(zs->unit >> 10));
+    fprintf(out, "  %llu passes, %llu MiB scanned, %llu MiB reclaimed\n",
+        (unsigned long long)zs->passes, (unsigned long long)(zs->scanned >> 20),
+        (unsigned long long)(zs->reclaimed >> 20));
+    fprintf(out, "  %llu candidates written before reclaim, vCPUs paused %llu us in total\n",
+        (unsigned long long)zs->raced, (unsigned long long)(zs->pause_ns / 1000));
+    fprintf(out, "  %llu batches dropped, unable to leave SCHED_IDLE\n",
+        (unsigned long long)zs->dropped);
+}
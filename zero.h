@@ -0,0 +1,19 @@
+#ifndef KVM__ZERO_H
+#define KVM__ZERO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "kvm.h"
+
+/*
+ * Background scanner that hands zero-filled guest pages back to the
+ * host. It reads at most @rate bytes of guest RAM per second, at
+ * SCHED_IDLE priority if the process may come back from it to pause
+ * the vCPUs, otherwise at normal priority. Pages are dropped at the backing page size,
+ * e.g. a THP backend only gives back whole zero 2M pages.
+ */
+int kvm__zero_scan_init(struct kvm *kvm, uint64_t rate);
+void kvm__zero_scan_exit(struct kvm *kvm);
+void kvm__zero_scan_dump(struct kvm *kvm, FILE *out);
+
+#endif /* KVM__ZERO_H */